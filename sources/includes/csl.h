@@ -41,8 +41,25 @@
 
 #include <SFML/Graphics.hpp>
 #include <SFML/System.hpp>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h> // OpenBSD serial setup
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <time.h>
 #include <vector>
 
 namespace csl {
@@ -51,7 +68,18 @@ class Push_button: public sf::Drawable
 {
     sf::Texture tex_on;
     sf::Texture tex_off;
-    int state {0};
+    int state {0}; // Logical state, 1 on / 0 off
+    int lit {0};   // Displayed state, updated by animate()
+
+    enum Mode {mode_steady, mode_blink, mode_pulse_on, mode_pulse_off};
+    Mode mode {mode_steady};
+    int locked {0};
+    int test {0};
+    int pulse_pending {0};
+    sf::Time pulse_start;
+    sf::Time period {sf::milliseconds(500)}; // Blink period or pulse length
+    static int headless; // No textures, see set_headless()
+    int load_size(std::string);
 
     public:
 
@@ -63,58 +91,156 @@ class Push_button: public sf::Drawable
         ~Push_button();
 
         virtual void draw(sf::RenderTarget& target, sf::RenderStates states) const;
+        void draw_state(sf::RenderTarget& target, int lit, sf::RenderStates states = sf::RenderStates::Default) const; /// Draw lit or not, reads no mutable state
 
         void load_tex_on(std::string);
         void load_tex_off(std::string);
         void load_tex_on_off(std::string, std::string);
+        static void set_headless(int); /// Before construction: keep sizes for hit tests, load no textures
 
         void set_on();
         void set_off();
-        void set_blink();
-        void set_pulse_on();
-        void set_pulse_off();
+        void set_blink(int period_ms = 500); /// Blink until next set_on/off, phase shared by all buttons
+        void set_pulse_on(int length_ms = 150); /// Light for length_ms, then off
+        void set_pulse_off(int length_ms = 150); /// Dark for length_ms, then on
         void set_toggle();
 
         void set_test();
         void set_normal();
 
-        void set_lock();
+        void set_lock(); /// Ignore illumination changes until unlocked
         void set_unlock();
 
-        void test_light_act();
+        void test_light_act(); /// Lamp test, force light on
         void test_light_dis();
 
+        void animate(sf::Time now); /// Update displayed state from timeline time
+
         int is_on();
         int is_off();
+        int is_lit(); /// Displayed state (animation, lamp test)
         int is_pressed(const sf::RenderWindow & win);
+        int is_pressed(int x, int y); /// Hit test at window coordinates (e.g. from an sf::Event)
 };
 
 
+/*
+ * Timeline
+ *
+ * Single time base driving all blinking / pulsing widgets. Call update()
+ * once per frame with the loop time (recorded one when replaying), before
+ * drawing.
+ */
+class Timeline {
+    sf::Time time;
+    std::vector<Push_button*> widgets;
+    int lamp_test {0};
+public:
+    void add(Push_button*);
+    void add(const std::vector<Push_button*> &);
+    void update(sf::Time now); /// Animate all widgets at loop time
+    sf::Time now(); /// Time of the last update()
+
+    void lamp_test_act(); /// Non-blocking lamp test, held until lamp_test_dis()
+    void lamp_test_dis();
+    int is_lamp_test();
+};
+
+
+/*
+ * Seven segment digit
+ *
+ * Drawn from polygons generated out of a segment bitmask, sharp at any scale.
+ * Bits 0-6: segments a-g, bit 7: decimal point, bit 8: colon (right of digit).
+ * At scale 1 a digit is 96 px high.
+ */
 class Seven_seg_digit {
-    sf::Texture dig_tex[11];
+    unsigned int segments {0};
+    sf::Vector2<float> position;
+    sf::Vector2<float> scale {1, 1};
+    sf::Color color_on {230, 30, 30};
+    sf::Color color_off {230, 30, 30, 35};
+    mutable sf::VertexArray mesh {sf::Triangles}; // Standalone draw only
+    mutable int dirty {1};
 public:
-    sf::Sprite dig_sprite;
+    static constexpr unsigned int seg_dot {1 << 7};
+    static constexpr unsigned int seg_colon {1 << 8};
+    static constexpr float height {96}; /// pix at scale 1
+    static constexpr float pitch {57.6}; /// Digit to digit spacing, pix at scale 1
+
     Seven_seg_digit();
-    void set_dig(int); /// Set the display value 0-9
-    void set_dot(int); /// TODO Set Dot
+    void set_dig(int); /// Set the display value 0-9, 10 for off
+    void set_dot(int); /// Decimal point on/off
+    void set_colon(int); /// Colon on/off
+    void set_segments(unsigned int); /// Raw bitmask
+    unsigned int get_segments() const;
+    void set_position(float x, float y); /// Top left
+    void set_scale(float scalex, float scaley);
+    void set_color(sf::Color on, sf::Color off);
+    void append_mesh(sf::VertexArray &) const; /// Append the digit triangles
     void draw(sf::RenderWindow *win); /// Standard SFML Draw
     int operator = (int); /// Another way to set digit value 0-9
 };
 
+/*
+ * Seven segment display
+ *
+ * Digit 0 is the right most one, set_position() refers to it. All digits
+ * share one mesh, rebuilt only when a segment, position or scale changes.
+ */
 class Seven_seg_display {
-    std::vector<std::shared_ptr<Seven_seg_digit>> seven_seg_digits;
-    const int h_spacing {30}; /// dx pix
+    std::vector<Seven_seg_digit> seven_seg_digits;
+    sf::Vector2<float> position;
+    sf::Vector2<float> scale {1, 1};
+    sf::VertexArray mesh {sf::Triangles};
+    int dirty {1};
+    void layout();
 public:
     Seven_seg_display (unsigned int);
     void draw(sf::RenderWindow *win);
     void set_digit(int, int); /// Digit, Value
-    void set_position (int x, int y); /// x, y
+    void set_dot(int, int); /// Digit, on/off
+    void set_colon(int, int); /// Digit, on/off
+    void set_position (float x, float y); /// x, y
     void set_scale (const float scalex, const float scaley); /// Scale x,y
     void set_scale (const float scale); /// Scale
+    void set_color (sf::Color on, sf::Color off);
     int operator = (int); /// Set display value
 };
 
 
+// ************* Snapshots *************
+
+/*
+ * Latest value mailbox between two threads. The writer publishes immutable
+ * snapshots, the reader gets the newest one, older ones are dropped.
+ */
+template <typename T>
+class Latest {
+    std::mutex m;
+    std::condition_variable published;
+    std::shared_ptr<const T> value;
+public:
+    void publish(std::shared_ptr<const T> v) {
+        {
+            std::lock_guard<std::mutex> l(m);
+            value.swap(v); // Previous snapshot released by v, after unlock
+        }
+        published.notify_one();
+    }
+    std::shared_ptr<const T> get() {
+        std::lock_guard<std::mutex> l(m);
+        return value;
+    }
+    /// Newest snapshot once it isn't last, or last after timeout
+    std::shared_ptr<const T> wait_newer(const std::shared_ptr<const T> &last, sf::Time timeout) {
+        std::unique_lock<std::mutex> l(m);
+        published.wait_for(l, std::chrono::microseconds(timeout.asMicroseconds()), [&]() {return value != last;});
+        return value;
+    }
+};
+
+
 // ************* Serial Communications *************
 
 /*
@@ -123,14 +249,8 @@ public:
  * - Define communication invariants
  */
 
-#include <stdio.h>
-#include <string.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <errno.h>
-
-// OpenBSD:
-#include <termios.h>
+class Session_recorder;
+class Session_player;
 
 class Serial {
 private:
@@ -138,14 +258,418 @@ private:
     const char *pport_default_linux = "/dev/ttyACM2";
     const char *pport_default_openbsd = "/dev/cuaU0";
     std::string str_out;
+    std::mutex write_lock; // Scheduler thread writes too
+    Session_recorder *recorder {nullptr};
+    Session_player *player {nullptr};
 public:
     Serial();
-    void non_blocking_write(int vin);
-    std::string blocking_read();
+    void non_blocking_write(int vin, int timed = 0); /// timed: from the Scheduler, recorded apart
+    const std::string &blocking_read(); /// Valid until the next call
+    int write_bytes(const char *, size_t); /// Bulk write, waits for room up to 100 ms, returns bytes written
+    void set_recorder(Session_recorder *); /// Record all traffic
+    void set_player(Session_player *); /// Read back from a recording, writes don't reach the port
     ~Serial();
 };
 
 
+// ************* Session record / replay *************
+
+/*
+ * Recording file layout (native byte order, same build only):
+ *
+ *   "CSLREC" u8 version u8 sizeof(sf::Event)
+ *   u8 type, then
+ *     rec_frame     u64 time (us)       one per main loop iteration
+ *     rec_event     raw sf::Event
+ *     rec_serial_rx u32 size, bytes     as returned by Serial::blocking_read()
+ *     rec_serial_tx u32 size, bytes     as written by Serial::non_blocking_write()
+ *     rec_serial_tx_timed               same, written by the Scheduler (version 2)
+ *
+ * Replay is frame by frame, so events and serial chunks are handed back in
+ * the exact interleaving they had, whatever the replay speed. Scheduler
+ * output is compared as a stream of its own, live it may land in later
+ * frames than the one that queued it.
+ */
+
+class Session_recorder {
+    std::ofstream file;
+    std::mutex lock; // Serial output may come from the scheduler thread
+    void write_bytes(unsigned char type, const char *, size_t);
+public:
+    enum Record {rec_frame = 1, rec_event, rec_serial_rx, rec_serial_tx, rec_serial_tx_timed};
+    int open(const std::string &); /// 1 on success
+    int is_open();
+    void frame(sf::Time); /// Mark the start of a main loop iteration at loop time, flushes the previous one
+    void event(const sf::Event &);
+    void serial_rx(const std::string &);
+    void serial_tx(const char *, size_t, int timed = 0);
+    void close();
+};
+
+class Session_player {
+    std::ifstream file;
+    sf::Clock clock;
+    int fast {0};
+    int has_next {0};
+    sf::Time next_time;
+    sf::Time frame_time;
+    std::vector<sf::Event> events;
+    size_t event_ix {0};
+    std::string rx;
+    std::string tx_expected;
+    std::string tx_actual;
+    std::string timed_expected; // Scheduler output, compared as a stream
+    std::string timed_actual;
+    unsigned long frames {0};
+    unsigned long tx_mismatches {0};
+    void check_tx();
+    void mismatch(const char *when, std::string &actual, std::string &expected);
+public:
+    int open(const std::string &, int as_fast_as_possible); /// 1 on success
+    int is_open();
+    int next_frame(); /// Load next frame, waiting for its time unless fast. 0 at end
+    sf::Time get_frame_time(); /// Recorded loop time of the current frame
+    int poll_event(sf::Event &); /// Same use as sf::Window::pollEvent
+    void serial_read(std::string &); /// Received data of the current frame
+    void serial_write(const char *, size_t, int timed = 0); /// Compared to the recorded traffic
+    unsigned long get_tx_mismatches();
+    void report();
+};
+
+
+// ************* Real-time *************
+
+/*
+ * Opt-in real-time settings for the calling thread (normally the scheduler
+ * thread, see Scheduler::start()). CPU affinity and SCHED_FIFO are Linux
+ * only, SCHED_FIFO and mlockall usually need CAP_SYS_NICE / CAP_IPC_LOCK or
+ * a suitable rlimit.
+ */
+class Realtime {
+public:
+    int cpu {-1};           /// Pin to this CPU, -1 to leave as is
+    int fifo_priority {0};  /// SCHED_FIFO priority 1-99, 0 to leave as is
+    int lock_memory {0};    /// mlockall current and future pages
+    int apply();            /// 1 when every requested setting took
+};
+
+/*
+ * Jitter probe
+ *
+ * Lateness of timed releases against their schedule, kept in a buffer
+ * allocated up front (oldest samples overwritten when full).
+ */
+class Jitter_probe {
+    std::vector<int64_t> late_ns;
+    size_t count {0};
+    size_t total {0};
+public:
+    Jitter_probe(size_t capacity = 4096);
+    void record(const timespec &scheduled, const timespec &actual);
+    void reset();
+    void report(const char *name);
+};
+
+/*
+ * Scheduler
+ *
+ * Releases serial commands at absolute deadlines (clock_nanosleep on
+ * CLOCK_MONOTONIC), so the period doesn't drift with wake-up latency.
+ *
+ * Once started, ramps are queued to a thread of its own and ramp() returns
+ * at once. Not started (replay), they run on the caller, so the output
+ * stays in the frame that asked for it.
+ */
+class Scheduler {
+    struct Job {int cmd; unsigned int steps; unsigned int dt_ms;};
+    Serial &serial;
+    Jitter_probe *probe {nullptr};
+    int timed {1};
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<Job> jobs;
+    int stopping {0};
+    void run(const Job &);
+public:
+    Scheduler(Serial &);
+    ~Scheduler();
+    void set_probe(Jitter_probe *);
+    void set_timed(int); /// 0: release at once (fast replay)
+    void start(Realtime); /// Run ramps on their own thread, with these real-time settings
+    void stop(); /// Finish queued ramps and join
+    void ramp(int cmd, unsigned int steps, unsigned int dt_ms); /// Send cmd steps times, dt_ms apart
+    static timespec now();
+    static void sleep_until(const timespec &deadline);
+};
+
+
+// ************* Ramp tables *************
+
+/*
+ * Acceleration / deceleration table computed on the host and downloaded
+ * to the controller in one transfer, a single command then plays it.
+ *
+ * Entries are the ramp shape, 0 to 2^resolution - 1 (full scale of the
+ * speed change), one per step. Payload, little endian:
+ *
+ *   u8 id, u16 count, u8 resolution, u16 step_us, u16 speed_delta,
+ *   count x u16 entry, u8 checksum (byte sum of the payload before it)
+ *
+ * step_us is how long each entry is held, speed_delta the speed change at
+ * full scale in firmware speed units (one unit per + / - command).
+ *
+ * Sent as 'T', the payload in upper case hex, '\n'. Digits and A-F are no
+ * commands, neither for firmware without ramp support nor for the ramp
+ * commands 'u' / 'd', so a lost 'T' or a dropped frame can't act on the
+ * table bytes. The firmware acknowledges each table with "T<id>OK".
+ */
+class Ramp_table {
+public:
+    enum Profile {trapezoidal, s_curve}; /// Constant acceleration, or jerk limited (smooth start and end)
+    std::vector<uint16_t> entries;
+    unsigned int resolution {12};
+    unsigned int step_us {1000};     /// Duration of each entry, us
+    unsigned int speed_delta {5};    /// Speed change at full scale, + / - command units
+
+    Ramp_table(Profile = trapezoidal, unsigned int steps = 64, unsigned int resolution = 12, int decelerate = 0);
+    void build(Profile, unsigned int steps, unsigned int resolution, int decelerate);
+    std::string encode(unsigned char id) const; /// Download frame
+    static std::string ack(unsigned char id);   /// Firmware reply to a good frame
+};
+
+
+// ************* Telemetry *************
+
+/*
+ * Axis telemetry, stored as struct of arrays (one array per quantity,
+ * indexed by axis) so conversions run as plain loops over all axes.
+ *
+ * Position readbacks are "<steps>>=", optionally tagged with the axis
+ * letter: "Y-1200>=". Untagged readbacks go to axis 0 (X).
+ */
+class Telemetry {
+public:
+    static constexpr int max_axes {6};
+    static constexpr const char *axis_names {"XYZABC"};
+    enum Flag {flag_seen = 1, flag_updated = 2};
+
+    int32_t steps[max_axes] {};     /// Raw readback, microsteps
+    double microsteps[max_axes];    /// Microsteps per unit
+    double position[max_axes] {};   /// Units
+    double velocity[max_axes] {};   /// Units / s
+    double age[max_axes] {};        /// s since last readback
+    uint32_t flags[max_axes] {};    /// Flag bits
+
+    Telemetry(int axis_count = 1, double microsteps_per_unit = 4);
+    int parse(const std::string &); /// Stage readbacks from a serial chunk, returns count
+    int update(sf::Time dt);        /// Convert staged readbacks, returns axes updated
+    int get_axis_count();
+    void log(std::ostream &);       /// One line, seen axes only
+private:
+    int axis_count;
+    std::string partial; // Readback split across chunks
+    static size_t readback_start(const std::string &, size_t end);
+};
+
+
+// ************* Toolpath view *************
+
+/*
+ * Toolpath preview
+ *
+ * The path is uploaded once into vertex buffer chunks, with decimated
+ * levels of detail (every 2^k th vertex) picked per chunk from the zoom.
+ * Chunks are culled through a bounding box hierarchy. Vertices are white
+ * and tinted by a 1x1 texture, so the executed part is drawn from the same
+ * buffers with another texture, nothing is uploaded again.
+ */
+class Toolpath_view: public sf::Drawable {
+    struct Chunk {
+        size_t first;                     // First path vertex
+        size_t count;                     // Path vertices, incl. the one shared with the next chunk
+        sf::FloatRect bounds;
+        float seg_len;                    // Mean segment length
+        std::vector<sf::VertexBuffer> lod;
+        std::vector<size_t> lod_count;
+    };
+    struct Node {
+        sf::FloatRect bounds;
+        int left, right;                  // Children, or -1
+        int chunk;                        // Leaf chunk, or -1
+    };
+    std::vector<sf::Vector2<float>> points;
+    std::vector<Chunk> chunks;
+    std::vector<Node> nodes;
+    sf::FloatRect bounds;
+    sf::Texture tex_pending;
+    sf::Texture tex_done;
+    sf::View view;
+    size_t executed {0};
+    int build_node(int first, int last);
+    void draw_chunk(sf::RenderTarget &, sf::RenderStates, const Chunk &, float px_size) const;
+public:
+    static constexpr size_t chunk_size {4096}; /// Path vertices per chunk
+    static constexpr int lod_levels {8};
+    static constexpr size_t track_window {256}; /// Vertices searched ahead by set_position()
+
+    Toolpath_view();
+    void set_path(const std::vector<sf::Vector2<float>> &);
+    int load_gcode(const std::string &); /// parse_gcode() on a file, then set_path(), 1 on success
+    static std::vector<sf::Vector2<float>> parse_gcode(std::istream &); /// G0-G3 X Y moves, arcs (I J or R) in 5 degree segments
+    void set_viewport(const sf::FloatRect &); /// Window fraction, as sf::View
+    void fit(float aspect); /// Whole path, aspect = viewport width / height in pixels
+    void zoom(float);
+    void set_position(sf::Vector2<float>); /// Machine position, advances the executed part
+    size_t get_executed();
+    size_t get_size();
+    virtual void draw(sf::RenderTarget& target, sf::RenderStates states) const;
+};
+
+
+// ************* Shared state *************
+
+/*
+ * Live machine state published in POSIX shared memory for local processes
+ * (MES agent, data logger...). One writer, any number of readers, seqlock:
+ * the sequence is odd while the writer updates, readers retry until they
+ * copied a snapshot with the same even sequence before and after. Neither
+ * side makes a syscall or takes a lock once the segment is mapped.
+ */
+struct State {
+    enum Mode {mode_on = 1, mode_off = 2, mode_auto = 4, mode_manual = 8, mode_pause = 16, mode_ccw = 32, mode_cw = 64};
+    uint32_t layout;                            /// state_layout, checked by readers
+    uint32_t mode;                              /// Mode bits
+    uint64_t frame;                             /// Publication count
+    uint64_t time_ns;                           /// CLOCK_MONOTONIC
+    uint64_t cycle_count;
+    uint32_t axis_count;
+    uint32_t reserved;
+    double position[Telemetry::max_axes];       /// Units
+    double velocity[Telemetry::max_axes];       /// Units / s
+};
+
+constexpr uint32_t state_layout {1};
+
+struct State_block {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> words[(sizeof(State) + 7) / 8];
+};
+
+class State_publisher {
+    int fd {-1};
+    State_block *block {nullptr};
+    std::string name;
+    uint64_t frame {0};
+public:
+    int open(const std::string &shm_name = "/csl_state"); /// 1 on success
+    int is_open();
+    void publish(State &); /// Sets layout, frame and time_ns
+    ~State_publisher();
+};
+
+class State_reader {
+    int fd {-1};
+    const State_block *block {nullptr};
+public:
+    int open(const std::string &shm_name = "/csl_state"); /// 1 on success
+    int read(State &, int max_tries = 1000); /// 1 on a consistent snapshot
+    ~State_reader();
+};
+
+
+// ************* Sequences *************
+
+/*
+ * Scripted machine sequences as C++20 coroutines, all run by a Sequencer
+ * on the main loop thread (no thread per sequence):
+ *
+ *   csl::Sequence run_cycles(csl::Sequencer &seq, int n) {
+ *       seq.send(MOT_CMD_RUN);
+ *       co_await seq.cycles(n);
+ *       seq.send(MOT_CMD_HOLD_POS);
+ *   }
+ *
+ * A suspended sequence costs nothing until the event it waits for is fed
+ * in (serial chunk, cycle mark, telemetry update) or its timer expires.
+ */
+class Sequencer;
+
+class Sequence {
+public:
+    struct promise_type {
+        Sequence get_return_object() {return Sequence {std::coroutine_handle<promise_type>::from_promise(*this)};}
+        std::suspend_always initial_suspend() noexcept {return {};} // Started by Sequencer::spawn()
+        std::suspend_always final_suspend() noexcept {return {};}   // Reaped by Sequencer::poll()
+        void return_void() {}
+        void unhandled_exception() {std::terminate();}
+    };
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Sequence(std::coroutine_handle<promise_type> h): handle(h) {}
+    Sequence(Sequence &&o): handle(o.handle) {o.handle = nullptr;}
+    Sequence(const Sequence &) = delete;
+    Sequence &operator = (Sequence &&);
+    ~Sequence();
+};
+
+class Sequencer {
+public:
+    enum Wait_kind {wait_delay, wait_position, wait_cycles, wait_text};
+
+    // Awaitable returned by delay(), position(), cycles() and received(),
+    // queued by address while the awaiting sequence is suspended
+    struct Wait {
+        Sequencer *seq {nullptr};
+        Wait_kind kind {wait_delay};
+        int axis {0};
+        double threshold {0};
+        int above {1};
+        uint64_t target {0};      // Cycle count, or rx stream offset for text
+        sf::Time deadline;        // Delay end, or timeout when timed
+        int timed {0};
+        bool ok {true};           // False when timed out
+        std::string text;
+        std::coroutine_handle<> handle;
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<>);
+        bool await_resume() {return ok;}
+    };
+
+    Sequencer(Serial &, Telemetry &);
+    void spawn(Sequence); /// Start a sequence, runs until its first wait
+    void poll(sf::Time now); /// Once per loop iteration at loop time (recorded one when replaying): timers, resume, reap
+    int running();
+
+    // Event feed, from the main loop
+    void on_serial(const std::string &);
+    void on_cycle(uint64_t count);
+    void on_telemetry();
+
+    // Awaitables
+    Wait delay(sf::Time); /// From the last poll() time
+    Wait position(int axis, double threshold, int above = 1); /// Until position >= (above) or <= threshold
+    Wait cycles(uint64_t n);                                   /// Until n more cycle marks
+    Wait received(const std::string &, sf::Time timeout = sf::Time::Zero); /// Until text is read on the serial line, false on timeout
+
+    void send(int cmd); /// Serial command
+
+private:
+    Serial &serial;
+    Telemetry &telemetry;
+    sf::Time now;
+    uint64_t cycle_count {0};
+    uint64_t rx_offset {0};   // Bytes received so far
+    std::string rx_tail;      // Last bytes received, for text split across chunks
+    std::vector<Sequence> sequences;
+    std::vector<Wait *> timers; // Min heap on deadline: delays and timeouts
+    std::vector<Wait *> waits;  // Position, cycle and text waits
+    std::vector<std::coroutine_handle<>> ready;
+    bool satisfied(const Wait &);
+    void wake(Wait_kind);
+};
+
+
 }
 
 #endif // CSL_H
@@ -49,23 +49,22 @@
  * - Panelize (panel class to hold position for widgets)
  * - Generalyze serial com
  * - Keep files in sync
- * - Migrate speed ramps (accelerations) into firmware
+ * - Migrate speed ramps (accelerations) into firmware (host tables done, --fw-ramps)
  *
  */
 
 #include <SFML/Graphics.hpp>
 #include <SFML/System.hpp>
+#include <atomic>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
 
 #include "csl.h"
 
 using namespace std;
 
-void ramp_up (unsigned int, unsigned int);
-void ramp_down (unsigned int, unsigned int);
-
 // Serial
 #define MOT_CMD_RUN       1
 #define MOT_CMD_SLEEP     2
@@ -78,17 +77,120 @@ void ramp_down (unsigned int, unsigned int);
 #define MOT_CMD_DIR_CW    9
 #define MOT_CMD_GO_SLOW   10
 #define MOT_CMD_HOLD_POS  11
+#define MOT_CMD_RAMP_UP   12
+#define MOT_CMD_RAMP_DOWN 13
 
 csl::Serial Serial;
+csl::Scheduler Scheduler {Serial};
+
+// Widget state handed from the control loop to the renderer, never modified once published
+struct Panel_snapshot {
+    vector<char> pb_lit;            // Per push button, in draw order
+    unsigned long cycle_count {0};
+    int pos {0};
+    int tool_pos_valid {0};
+    sf::Vector2<float> tool_pos;
+    int zoom_steps {0};             // Mouse wheel, + zooms in
+    bool operator == (const Panel_snapshot &) const = default;
+};
+
+// Run n cycles, then hold position
+csl::Sequence run_cycles(csl::Sequencer &seq, int n) {
+    cout << "Sequence: run " << n << " cycles" << endl;
+    seq.send(MOT_CMD_RUN);
+    co_await seq.cycles(n);
+    seq.send(MOT_CMD_HOLD_POS);
+    cout << "Sequence: " << n << " cycles done, hold" << endl;
+}
+
+// Download firmware ramp tables one at a time, each must be acknowledged
+csl::Sequence download_ramps(csl::Sequencer &seq, vector<csl::Ramp_table> tables, int &ready) {
+    for (size_t i {0}; i < tables.size(); i++) {
+        const string frame {tables[i].encode(i)};
+        Serial.write_bytes(frame.data(), frame.size());
+        if (!co_await seq.received(csl::Ramp_table::ack(i), sf::milliseconds(500))) {
+            cout << "Firmware ramps: table " << i << " not acknowledged, using host ramps" << endl;
+            co_return;
+        }
+    }
+    ready = 1;
+    cout << "Firmware ramps: ready" << endl;
+}
+
+// Host speed ramp: + / - commands, ms apart (firmware tables cover the same change)
+static const int ramp_cmds {5}, ramp_cmd_ms {15};
 
-int main()
+int main(int argc, char *argv[])
 {
+    // Options
+    string record_file, replay_file, gcode_file, shm_name;
+    int fast {0}, headless {0}, jitter {0}, axes {1}, axis_log {0};
+    int fw_ramps {0}, ramp_steps {64}, ramp_bits {12}, run_cycle_count {0}, render_thread {0};
+    csl::Ramp_table::Profile ramp_profile {csl::Ramp_table::trapezoidal};
+    csl::Realtime realtime;
+    auto usage = [&]() {
+        cout << "Usage: " << argv[0] << " [--record file] [--replay file [--fast] [--headless]]"
+             << " [--rt-cpu n] [--rt-prio n] [--rt-mlock] [--jitter] [--axes n] [--axis-log]"
+             << " [--gcode file] [--shm /name] [--fw-ramps trapezoidal|s-curve [--ramp-steps n] [--ramp-bits n]]"
+             << " [--cycles n] [--render-thread]" << endl;
+        return EXIT_FAILURE;
+    };
+    for (int i {1}; i < argc; i++) {
+        const string arg {argv[i]};
+        if (arg == "--record" && i + 1 < argc) record_file = argv[++i];
+        else if (arg == "--replay" && i + 1 < argc) replay_file = argv[++i];
+        else if (arg == "--fast") fast = 1;
+        else if (arg == "--headless") headless = 1;
+        else if (arg == "--rt-cpu" && i + 1 < argc) realtime.cpu = atoi(argv[++i]);
+        else if (arg == "--rt-prio" && i + 1 < argc) realtime.fifo_priority = atoi(argv[++i]);
+        else if (arg == "--rt-mlock") realtime.lock_memory = 1;
+        else if (arg == "--jitter") jitter = 1;
+        else if (arg == "--axes" && i + 1 < argc) axes = atoi(argv[++i]);
+        else if (arg == "--axis-log") axis_log = 1;
+        else if (arg == "--gcode" && i + 1 < argc) gcode_file = argv[++i];
+        else if (arg == "--shm" && i + 1 < argc) shm_name = argv[++i];
+        else if (arg == "--fw-ramps" && i + 1 < argc) {
+            const string p {argv[++i]};
+            fw_ramps = 1;
+            if (p == "s-curve") ramp_profile = csl::Ramp_table::s_curve;
+            else if (p != "trapezoidal") return usage();
+        }
+        else if (arg == "--ramp-steps" && i + 1 < argc) ramp_steps = atoi(argv[++i]);
+        else if (arg == "--ramp-bits" && i + 1 < argc) ramp_bits = atoi(argv[++i]);
+        else if (arg == "--cycles" && i + 1 < argc) run_cycle_count = atoi(argv[++i]);
+        else if (arg == "--render-thread") render_thread = 1;
+        else return usage();
+    }
+    if (gcode_file.size() && axes < 2) {
+        // Toolpath follows X and Y readbacks
+        cout << "--gcode: using 2 axes" << endl;
+        axes = 2;
+    }
+    if (headless && replay_file.empty()) {
+        cout << "--headless needs --replay" << endl;
+        return EXIT_FAILURE;
+    }
+
+    // Session record / replay
+    csl::Session_recorder recorder;
+    csl::Session_player player;
+    if (record_file.size()) {
+        if (!recorder.open(record_file)) return EXIT_FAILURE;
+        Serial.set_recorder(&recorder);
+    }
+    if (replay_file.size()) {
+        if (!player.open(replay_file, fast)) return EXIT_FAILURE;
+        Serial.set_player(&player);
+    }
+
     // Create the main window
-    sf::RenderWindow window(sf::VideoMode(908, 468), "CNC Gui");
+    sf::RenderWindow window;
+    if (!headless) window.create(sf::VideoMode(908, 468), "CNC Gui");
 
     // Load a sprite to display
 
-    // Instanciate buttons
+    // Instanciate buttons, headless replay has no GL context for textures
+    csl::Push_button::set_headless(headless);
     csl::Push_button reset_pb {"medias/bitmap25.png", "medias/bitmap26.png", sf::Vector2<float>(780,350), 0.50};
     csl::Push_button test_pb {"medias/bitmap27.png", "medias/bitmap28.png", sf::Vector2<float>(690,350), 0.50};
 
@@ -120,9 +222,13 @@ int main()
     pb_v.push_back(&on_pb);
     pb_v.push_back(&off_pb);
 
+    // Blink, pulse and lamp test animations
+    csl::Timeline timeline;
+    timeline.add(pb_v);
+
     // Background
     sf::Texture tex_bg;
-    if (!tex_bg.loadFromFile("medias/bg.png")) return EXIT_FAILURE;
+    if (!headless && !tex_bg.loadFromFile("medias/bg.png")) return EXIT_FAILURE;
     sf::Sprite sprite_bg(tex_bg);
     sprite_bg.setScale(0.7, 0.7);
 
@@ -132,7 +238,7 @@ int main()
     {
         // 7 Seg Font
 
-        if (!font_lcd_display.loadFromFile("fonts/7segment.ttf")) {
+        if (!headless && !font_lcd_display.loadFromFile("fonts/7segment.ttf")) {
             cout << "Error loading font" << endl;
             return EXIT_FAILURE;
         }
@@ -144,14 +250,27 @@ int main()
         lcd_display.setString("GOOD NORNING LCD 240\n1234567890 ABCDEFGHI");
     }
 
+    // Toolpath preview, in place of the LCD text (mouse wheel zooms)
+    unique_ptr<csl::Toolpath_view> toolpath;
+    if (gcode_file.size() && !headless) {
+        toolpath = make_unique<csl::Toolpath_view>();
+        if (!toolpath->load_gcode(gcode_file)) return EXIT_FAILURE;
+        const sf::FloatRect area {70, 100, 520, 120}; // LCD area, pix
+        const sf::Vector2u ws {window.getSize()};
+        toolpath->set_viewport(sf::FloatRect(area.left / ws.x, area.top / ws.y, area.width / ws.x, area.height / ws.y));
+        toolpath->fit(area.width / area.height);
+        cout << "Toolpath: " << toolpath->get_size() << " points" << endl;
+    }
+
     // 7 Segment displays
     csl::Seven_seg_display cyc {5}, spd {5}, pos {5}, cur {5};
     {
-        const sf::Vector2<int> ref_pos {713 + 4*30, 90}; // Pos 713 from left dig
-                                                         // while 7-seg digits class
-                                                         // pos ref on right most digit
-        const int v_spacing {64};
         const float scale {0.55};
+        const float dig_spacing {csl::Seven_seg_digit::pitch * scale};
+        const sf::Vector2<float> ref_pos {713 + 4*dig_spacing, 90}; // Pos 713 from left dig
+                                                                    // while 7-seg digits class
+                                                                    // pos ref on right most digit
+        const int v_spacing {64};
         cyc.set_position(ref_pos.x, ref_pos.y + 0 * v_spacing);
         spd.set_position(ref_pos.x, ref_pos.y + 1 * v_spacing);
         pos.set_position(ref_pos.x, ref_pos.y + 2 * v_spacing);
@@ -162,17 +281,133 @@ int main()
         cur.set_scale(scale);
     }
 
-  window.setFramerateLimit(60);
+  // Replay paces itself from the recording, a render thread keeps the limit
+  if (!headless) window.setFramerateLimit(player.is_open() && !render_thread ? 0 : 60);
+
+  // Renderer, owns the displays and the toolpath view once started
+  int applied_zoom {0};
+  auto render = [&](const Panel_snapshot &snap) {
+      if (snap.cycle_count) cyc = snap.cycle_count;
+      pos = snap.pos;
+      if (toolpath) {
+          if (snap.tool_pos_valid) toolpath->set_position(snap.tool_pos);
+          for (; applied_zoom < snap.zoom_steps; applied_zoom++) toolpath->zoom(0.8);
+          for (; applied_zoom > snap.zoom_steps; applied_zoom--) toolpath->zoom(1.25);
+      }
+
+      // Clear screen
+      window.clear(sf::Color(219,226,227,255));
+
+      // Draw the sprite
+      window.draw(sprite_bg);
+
+      // Draw PBs
+      for (size_t i {0}; i < pb_v.size(); i++) pb_v[i]->draw_state(window, snap.pb_lit[i]);
+
+      if (toolpath) window.draw(*toolpath);
+      else window.draw(lcd_display);
+
+      cyc.draw(&window);
+      spd.draw(&window);
+      pos.draw(&window);
+      cur.draw(&window);
+
+      // Update the window
+      window.display();
+  };
+
+  // Axis readbacks, pos display shows one axis (keys X Y Z A B C)
+  csl::Telemetry telemetry {axes};
+  int pos_axis {0};
+
+  // Live state for local co-processes
+  csl::State_publisher state_pub;
+  if (shm_name.size() && !state_pub.open(shm_name)) return EXIT_FAILURE;
+  unsigned long cycle_count {0};
+
+  // Scripted sequences, fed from the readbacks below
+  csl::Sequencer sequencer {Serial, telemetry};
+
+  // Optional render thread, so frame time (vsync, driver stalls) doesn't delay input handling
+  csl::Latest<Panel_snapshot> panel;
+  Panel_snapshot panel_state;
+  shared_ptr<const Panel_snapshot> published;
+  atomic<int> rendering {0};
+  thread renderer;
+  if (render_thread && !headless) {
+      rendering = 1;
+      window.setActive(false);
+      renderer = thread([&]() {
+          window.setActive(true);
+          shared_ptr<const Panel_snapshot> shown;
+          while (rendering) {
+              // Draw only what changed, the window keeps the last frame
+              const auto snap {panel.wait_newer(shown, sf::milliseconds(100))};
+              if (snap == shown) continue;
+              shown = snap;
+              render(*snap);
+          }
+          window.setActive(false);
+      });
+  }
 
-  // Init
+  // Timed commands on a thread of their own, with the real-time settings.
+  // A replay runs them in the frame that asked, without waiting when fast
+  csl::Jitter_probe ramp_jitter;
+  if (jitter) Scheduler.set_probe(&ramp_jitter);
+  if (player.is_open()) Scheduler.set_timed(!fast);
+  else Scheduler.start(realtime);
+
+  // Events come from the window, or from the recording when replaying
+  int running {1}, zoom_steps {0};
+  auto poll_event = [&](sf::Event &ev) {
+      if (!player.is_open()) {
+          if (!window.pollEvent(ev)) return false;
+          recorder.event(ev);
+          return true;
+      }
+      sf::Event wev;
+      while (window.isOpen() && window.pollEvent(wev)) {
+          if (wev.type == sf::Event::Closed) running = 0;
+      }
+      return player.poll_event(ev) != 0;
+  };
+
+  // Loop time, the recorded one when replaying, so timed waits replay alike
+  sf::Clock loop_clock;
+  sf::Time frame_time, telemetry_time;
+  auto next_frame = [&]() {
+      if (player.is_open()) {
+          if (!player.next_frame()) return false;
+          frame_time = player.get_frame_time();
+      } else frame_time = loop_clock.getElapsedTime();
+      recorder.frame(frame_time);
+      return true;
+  };
+
+  // Init, recorded as the first frame
+  next_frame();
   Serial.non_blocking_write(MOT_CMD_SLEEP);
   Serial.non_blocking_write(MOT_CMD_MODE_MAN);
   Serial.non_blocking_write(MOT_CMD_DIR_CW);
+  int fw_ramps_ready {0};
+  if (fw_ramps) {
+      // Speed ramps played by the firmware, tables 0 (up) and 1 (down), same
+      // speed change and duration as the host ramp. Host ramps until acknowledged
+      vector<csl::Ramp_table> tables;
+      for (int down {0}; down < 2; down++) {
+          tables.emplace_back(ramp_profile, (unsigned int)ramp_steps, (unsigned int)ramp_bits, down);
+          tables.back().step_us = ramp_cmds * ramp_cmd_ms * 1000 / tables.back().entries.size();
+          tables.back().speed_delta = ramp_cmds;
+      }
+      sequencer.spawn(download_ramps(sequencer, tables, fw_ramps_ready));
+  }
+  if (run_cycle_count > 0) sequencer.spawn(run_cycles(sequencer, run_cycle_count));
 
   // ************* Main loop *************
 
 	// Start the game loop
-    while (window.isOpen())
+    while (running)
     {
         // 7 segment display demo
         /*
@@ -183,19 +418,21 @@ int main()
         cur = cur_cnt++;
         */
 
+        // Frame boundary, a replay hands out this frame's events and serial chunks
+        if (!next_frame()) break;
+
         // Process events
         sf::Event event;
-        while (window.pollEvent(event))
+        while (poll_event(event))
         {
             // Close window : exit
-            if (event.type == sf::Event::Closed)
-                window.close();
+            if (event.type == sf::Event::Closed) running = 0;
             // Mouse click
             {
                 if (event.type == sf::Event::MouseButtonPressed) {
-                    if (sf::Mouse::isButtonPressed(sf::Mouse::Left)) {
-                        sf::Vector2<int> mp = sf::Mouse::getPosition(window);
-                        if (on_pb.is_pressed(window)) {
+                    if (event.mouseButton.button == sf::Mouse::Left) {
+                        const int mx {event.mouseButton.x}, my {event.mouseButton.y};
+                        if (on_pb.is_pressed(mx, my)) {
                             cout << "Click Sprite P1 ON" << endl;
                             Serial.non_blocking_write(MOT_CMD_HOLD_POS);
                             // Serial.non_blocking_write(MOT_CMD_RUN);
@@ -209,7 +446,7 @@ int main()
                                 pause_pb.set_off();
                                 cw_pb.set_off();
                             }
-                        } else if (off_pb.is_pressed(window)) {
+                        } else if (off_pb.is_pressed(mx, my)) {
                             cout << "Click Sprite P2 OFF" << endl;
                             Serial.non_blocking_write(MOT_CMD_SLEEP);
                             // Push buttons illumination
@@ -219,7 +456,7 @@ int main()
                                 on_pb.set_off();
                                 off_pb.set_on();
                             }
-                        } else if (pause_pb.is_pressed(window)) {
+                        } else if (pause_pb.is_pressed(mx, my)) {
                             cout << "Click Sprite P3 Pause" << endl;
                             Serial.non_blocking_write(MOT_CMD_PAUSE);
                             // Push buttons illumination
@@ -228,7 +465,7 @@ int main()
                                 pause_pb.set_on();
                                 cw_pb.set_off();
                             }
-                        } else if (a_pb.is_pressed(window)) {
+                        } else if (a_pb.is_pressed(mx, my)) {
                             cout << "Click Sprite P4 Auto" << endl;
                             Serial.non_blocking_write(MOT_CMD_MODE_AUTO);
                             // Push buttons illumination
@@ -236,7 +473,7 @@ int main()
                                 a_pb.set_on();
                                 m_pb.set_off();
                             }
-                        } else if (m_pb.is_pressed(window)) {
+                        } else if (m_pb.is_pressed(mx, my)) {
                             cout << "Click Sprite P5 Man" << endl;
                             Serial.non_blocking_write(MOT_CMD_MODE_MAN);
                             // Push buttons illumination
@@ -244,37 +481,17 @@ int main()
                                 a_pb.set_off();
                                 m_pb.set_on();
                             }
-                        } else if (plus_pb.is_pressed(window)) {
+                        } else if (plus_pb.is_pressed(mx, my)) {
                             cout << "Click Sprite P6 Spd +" << endl;
-                            // Push buttons illumination
-                            {
-                                plus_pb.set_on();
-                                window.draw(plus_pb);
-                              window.display();
-                            }
-                            ramp_up(5, 15);
-                            // Push buttons illumination
-                            {
-                                plus_pb.set_off();
-                                window.draw(plus_pb);
-                              window.display();
-                            }
-                        } else if (minus_pb.is_pressed(window)) {
+                            plus_pb.set_pulse_on();
+                            if (fw_ramps_ready) Serial.non_blocking_write(MOT_CMD_RAMP_UP);
+                            else Scheduler.ramp(MOT_CMD_SPD_PLUS, ramp_cmds, ramp_cmd_ms);
+                        } else if (minus_pb.is_pressed(mx, my)) {
                             cout << "Click Sprite P7 Spd -" << endl;
-                            // Push buttons illumination
-                            {
-                                minus_pb.set_on();
-                                window.draw(minus_pb);
-                                window.display();
-                            }
-                            ramp_down(5, 15);
-                            // Push buttons illumination
-                            {
-                                minus_pb.set_off();
-                                window.draw(minus_pb);
-                                window.display();
-                            }
-                        } else if (ccw_pb.is_pressed(window)) {
+                            minus_pb.set_pulse_on();
+                            if (fw_ramps_ready) Serial.non_blocking_write(MOT_CMD_RAMP_DOWN);
+                            else Scheduler.ramp(MOT_CMD_SPD_MINUS, ramp_cmds, ramp_cmd_ms);
+                        } else if (ccw_pb.is_pressed(mx, my)) {
                             cout << "Click Sprite P8 Dir CCW" << endl;
                             Serial.non_blocking_write(MOT_CMD_DIR_CCW);
                             // Push buttons illumination
@@ -283,7 +500,7 @@ int main()
                                 pause_pb.set_off();
                                 cw_pb.set_off();
                             }
-                        } else if (cw_pb.is_pressed(window)) {
+                        } else if (cw_pb.is_pressed(mx, my)) {
                             cout << "Click Sprite P9 Dir CW" << endl;
                             Serial.non_blocking_write(MOT_CMD_DIR_CW);
                             // Push buttons illumination
@@ -292,20 +509,21 @@ int main()
                                 pause_pb.set_off();
                                 cw_pb.set_on();
                             }
-                        } else if (test_pb.is_pressed(window)) {
-                            while (sf::Mouse::isButtonPressed(sf::Mouse::Left)) {
-                                for (auto i:pb_v) {
-                                    i->set_test();
-                                    window.draw(*i);
-                                }
-                                window.display();
-                            }
-                            for (auto i:pb_v) i->set_normal();
+                        } else if (test_pb.is_pressed(mx, my)) {
+                            // Lamp test, held until the button is released
+                            timeline.lamp_test_act();
                         }
                     }
+                } else if (event.type == sf::Event::MouseButtonReleased) {
+                    if (timeline.is_lamp_test()) timeline.lamp_test_dis();
+                } else if (event.type == sf::Event::MouseWheelScrolled) {
+                    zoom_steps += event.mouseWheelScroll.delta > 0 ? 1 : -1;
                 } else if (event.type == sf::Event::KeyPressed) {
                     auto kp {event.key.code};
                     cout << kp << endl;
+                    const sf::Keyboard::Key axis_keys[csl::Telemetry::max_axes] {sf::Keyboard::X, sf::Keyboard::Y, sf::Keyboard::Z,
+                                                                                 sf::Keyboard::A, sf::Keyboard::B, sf::Keyboard::C};
+                    for (int i {0}; i < telemetry.get_axis_count(); i++) if (kp == axis_keys[i]) pos_axis = i;
                     if (kp == 15) {
                         if (event.key.control) cout << "Ctrl P" << endl;
                         else if (event.key.alt) cout << "Alt P" << endl;
@@ -317,87 +535,81 @@ int main()
         }
 
         // Load text
-        static string str;
-        str = Serial.blocking_read();
+        const string &str {Serial.blocking_read()};
         if (str.size()) {
           // cout << str << flush;
-          // Cases (read backs from control board)
+          sequencer.on_serial(str);
+          // Cases (read backs from control board), a chunk may hold both
           if (str.find('.') != string::npos) {
-                static unsigned int cycle_count {0};
                 cycle_count++;
-                cyc = cycle_count;
-          } else if (str.find(">=") != string::npos) {
-            int stepper_position {0};
-
-            std::string s {str};
-            std::string delimiter = ">=";
-
-            size_t pos_l = 0;
-            std::string token;
-            while ((pos_l = s.find(delimiter)) != std::string::npos) {
-                token = s.substr(0, pos_l);
-                // std::cout << "<" << token << ">" << std::endl;
-                if (token.size()) {
-                int token_sane {1};
-                for (auto i:token) {
-                  if ((i != '-') && (i != '0') && (i != '1') && (i != '2') && \
-                      (i != '3') && (i != '4') && (i != '5') && (i != '6') && \
-                      (i != '7') && (i != '8') && (i != '9')) token_sane = 0;
-                  }
-                  if (token_sane) {
-                    stepper_position = stoi(token);
-                    pos = stepper_position / 4; // Unit / microsteps conversion
-                  }
-                }
-                s.erase(0, pos_l + delimiter.length());
-            }
+                sequencer.on_cycle(cycle_count);
           }
-          str = "";
+          telemetry.parse(str);
         }
 
-        // Clear screen
-        window.clear(sf::Color(219,226,227,255));
-
-        // Draw the sprite
-        window.draw(sprite_bg);
+        // Axis positions, velocities
+        if (telemetry.update(frame_time - telemetry_time)) {
+            if (axis_log) telemetry.log(cout);
+            sequencer.on_telemetry();
+        }
+        telemetry_time = frame_time;
+        sequencer.poll(frame_time);
+
+        // Publish state (commanded mode from the panel lamps)
+        if (state_pub.is_open()) {
+            csl::State st {};
+            st.mode = (on_pb.is_on() ? csl::State::mode_on : 0) | (off_pb.is_on() ? csl::State::mode_off : 0) |
+                      (a_pb.is_on() ? csl::State::mode_auto : 0) | (m_pb.is_on() ? csl::State::mode_manual : 0) |
+                      (pause_pb.is_on() ? csl::State::mode_pause : 0) | (ccw_pb.is_on() ? csl::State::mode_ccw : 0) |
+                      (cw_pb.is_on() ? csl::State::mode_cw : 0);
+            st.cycle_count = cycle_count;
+            st.axis_count = telemetry.get_axis_count();
+            for (int i {0}; i < csl::Telemetry::max_axes; i++) {
+                st.position[i] = telemetry.position[i];
+                st.velocity[i] = telemetry.velocity[i];
+            }
+            state_pub.publish(st);
+        }
 
-        // Draw PBs
-        for (auto i:pb_v) window.draw(*i);
+        // Blink / pulse / lamp test
+        timeline.update(frame_time);
+
+        if (headless) continue;
+
+        // Widget state for the renderer, updated in place
+        panel_state.pb_lit.resize(pb_v.size());
+        for (size_t i {0}; i < pb_v.size(); i++) panel_state.pb_lit[i] = pb_v[i]->is_lit();
+        panel_state.cycle_count = cycle_count;
+        panel_state.pos = telemetry.position[pos_axis]; // Units (microsteps converted)
+        panel_state.tool_pos_valid = telemetry.flags[0] & csl::Telemetry::flag_seen;
+        panel_state.tool_pos = sf::Vector2<float>(telemetry.position[0], telemetry.position[1]);
+        panel_state.zoom_steps = zoom_steps;
+
+        if (renderer.joinable()) {
+            // A new snapshot only when something changed
+            if (!published || !(*published == panel_state)) {
+                published = make_shared<const Panel_snapshot>(panel_state);
+                panel.publish(published);
+            }
+            // Rendering no longer paces this loop (a replay paces itself)
+            if (!player.is_open()) sf::sleep(sf::milliseconds(2));
+        } else render(panel_state);
+    }
 
-        window.draw(lcd_display);
+    if (renderer.joinable()) {
+        rendering = 0;
+        renderer.join();
+        window.setActive(true);
+    }
+    window.close();
 
-        cyc.draw(&window);
-        spd.draw(&window);
-        pos.draw(&window);
-        cur.draw(&window);
+    Scheduler.stop();
+    if (jitter) ramp_jitter.report("speed ramps");
 
-        // Update the window
-        window.display();
+    if (player.is_open()) {
+        player.report();
+        if (player.get_tx_mismatches()) return EXIT_FAILURE;
     }
 
     return EXIT_SUCCESS;
 }
-
-void ramp_up (unsigned int steps, unsigned int dt_ms) {
-  sf::Clock clock;
-  sf::Time dt {sf::milliseconds (dt_ms)};
-
-  for (int i {0}; i < steps; i++) {
-    // Delay
-    while (clock.getElapsedTime() < dt);
-    clock.restart();
-    Serial.non_blocking_write(MOT_CMD_SPD_PLUS);
-  }
-
-}
-void ramp_down (unsigned int steps, unsigned int dt_ms) {
-  sf::Clock clock;
-  sf::Time dt {sf::milliseconds (dt_ms)};
-
-  for (int i {0}; i < steps; i++) {
-    // Delay
-    while (clock.getElapsedTime() < dt);
-    clock.restart();
-    Serial.non_blocking_write(MOT_CMD_SPD_MINUS);
-  }
-}
@@ -37,6 +37,16 @@
 
 #include "csl.h"
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 
 // ************* Push-button *************
 
@@ -54,19 +64,40 @@ csl::Push_button::Push_button(std::string s_on_in, std::string s_off_in, sf::Vec
     sprite.setScale(scale_in, scale_in);
 }
 
+int csl::Push_button::headless {0};
+void csl::Push_button::set_headless(int on) {headless = on;}
+
+// Without a GL context only the size is taken from the image, hit tests still work
+int csl::Push_button::load_size(std::string s_in) {
+    sf::Image img;
+    if (!img.loadFromFile(s_in)) {std::cout << "Error loading push button image: " << s_in << std::endl; return 0;}
+    sprite.setTextureRect(sf::IntRect(0, 0, img.getSize().x, img.getSize().y));
+    return 1;
+}
+
 void csl::Push_button::load_tex_on(std::string s_in) {
+    if (headless) {
+        if (load_size(s_in)) {state = 1; lit = 1;}
+        return;
+    }
     if (!tex_on.loadFromFile(s_in)) {std::cout << "Error loading push button texture: " << s_in << std::endl; /*Err handling*/}
     else {
         sprite.setTexture(tex_on);
         state = 1;
+        lit = 1;
     }
 }
 
 void csl::Push_button::load_tex_off(std::string s_in) {
+    if (headless) {
+        if (load_size(s_in)) {state = 0; lit = 0;}
+        return;
+    }
     if (!tex_off.loadFromFile(s_in)) {std::cout << "Error loading push button texture: " << s_in << std::endl; /*Err handling*/}
     else {
         sprite.setTexture(tex_off);
         state = 0;
+        lit = 0;
     }
 }
 
@@ -76,56 +107,229 @@ void csl::Push_button::load_tex_on_off(std::string tex_on_in, std::string tex_of
 }
 
 void csl::Push_button::draw(sf::RenderTarget& target, sf::RenderStates states) const {
-    //target.draw(sprite, states);
-    target.draw(sprite);
+    draw_state(target, lit || test, states);
+}
+
+// Sprite and textures are only set at load time, safe from a render thread
+void csl::Push_button::draw_state(sf::RenderTarget& target, int lit_in, sf::RenderStates states) const {
+    sf::Sprite s {sprite};
+    s.setTexture(lit_in ? tex_on : tex_off);
+    target.draw(s, states);
 }
 
 void csl::Push_button::set_on() {
-    sprite.setTexture(tex_on);
+    if (locked) return;
+    mode = mode_steady;
     state = 1;
+    lit = 1;
 }
 void csl::Push_button::set_off() {
-    sprite.setTexture(tex_off);
+    if (locked) return;
+    mode = mode_steady;
     state = 0;
+    lit = 0;
+}
+void csl::Push_button::set_toggle() {
+    if (state) set_off();
+    else set_on();
+}
+
+void csl::Push_button::set_blink(int period_ms) {
+    if (locked) return;
+    mode = mode_blink;
+    period = sf::milliseconds(period_ms > 1 ? period_ms : 2);
+}
+
+// Pulse start time is taken at the next animate(), so the button doesn't need the clock
+void csl::Push_button::set_pulse_on(int length_ms) {
+    if (locked) return;
+    mode = mode_pulse_on;
+    period = sf::milliseconds(length_ms);
+    pulse_pending = 1;
+    lit = 1;
 }
+void csl::Push_button::set_pulse_off(int length_ms) {
+    if (locked) return;
+    mode = mode_pulse_off;
+    period = sf::milliseconds(length_ms);
+    pulse_pending = 1;
+    lit = 0;
+}
+
+void csl::Push_button::set_lock() {locked = 1;}
+void csl::Push_button::set_unlock() {locked = 0;}
+
+void csl::Push_button::test_light_act() {test = 1;}
+void csl::Push_button::test_light_dis() {test = 0;}
+
+void csl::Push_button::animate(sf::Time now) {
+    if (pulse_pending) {
+        pulse_start = now;
+        pulse_pending = 0;
+    }
+    switch (mode) {
+    case mode_steady:
+        lit = state;
+        break;
+    case mode_blink:
+        lit = (now.asMilliseconds() / (period.asMilliseconds() / 2)) % 2 == 0;
+        break;
+    case mode_pulse_on:
+    case mode_pulse_off:
+        if (now - pulse_start < period) lit = (mode == mode_pulse_on);
+        else {
+            state = (mode == mode_pulse_off);
+            lit = state;
+            mode = mode_steady;
+        }
+        break;
+    }
+}
+
+int csl::Push_button::is_on() {return state;}
+int csl::Push_button::is_off() {return !state;}
+int csl::Push_button::is_lit() {return lit || test;}
 
 int csl::Push_button::is_pressed(const sf::RenderWindow &win) {
     sf::Vector2<int> mp = sf::Mouse::getPosition(win);
-    return sprite.getGlobalBounds().contains(mp.x, mp.y);
+    return is_pressed(mp.x, mp.y);
+}
+int csl::Push_button::is_pressed(int x, int y) {
+    return sprite.getGlobalBounds().contains(x, y);
+}
+
+void csl::Push_button::set_test() {test_light_act();}
+void csl::Push_button::set_normal() {test_light_dis();}
+
+
+// ************* Timeline *************
+
+void csl::Timeline::add(Push_button *pb) {widgets.push_back(pb);}
+void csl::Timeline::add(const std::vector<Push_button*> &pbs) {for (auto i:pbs) add(i);}
+
+sf::Time csl::Timeline::now() {return time;}
+
+void csl::Timeline::update(sf::Time t) {
+    time = t;
+    for (auto i:widgets) i->animate(t);
 }
 
-void csl::Push_button::set_test() {
-    sprite.setTexture(tex_on);
+void csl::Timeline::lamp_test_act() {
+    lamp_test = 1;
+    for (auto i:widgets) i->test_light_act();
 }
-void csl::Push_button::set_normal() {
-    if (state) sprite.setTexture(tex_on);
-    else sprite.setTexture(tex_off);
+void csl::Timeline::lamp_test_dis() {
+    lamp_test = 0;
+    for (auto i:widgets) i->test_light_dis();
 }
+int csl::Timeline::is_lamp_test() {return lamp_test;}
 
 
 // ************* Seven Segment Digit *************
 
-csl::Seven_seg_digit::Seven_seg_digit() {
-    if (!dig_tex[0].loadFromFile("medias/7seg_0.png")) {std::cout << "Seven_seg_digit: error loading texture 0" << std::endl;};
-    if (!dig_tex[1].loadFromFile("medias/7seg_1.png")) {std::cout << "Seven_seg_digit: error loading texture 1" << std::endl;};
-    if (!dig_tex[2].loadFromFile("medias/7seg_2.png")) {std::cout << "Seven_seg_digit: error loading texture 2" << std::endl;};
-    if (!dig_tex[3].loadFromFile("medias/7seg_3.png")) {std::cout << "Seven_seg_digit: error loading texture 3" << std::endl;};
-    if (!dig_tex[4].loadFromFile("medias/7seg_4.png")) {std::cout << "Seven_seg_digit: error loading texture 4" << std::endl;};
-    if (!dig_tex[5].loadFromFile("medias/7seg_5.png")) {std::cout << "Seven_seg_digit: error loading texture 5" << std::endl;};
-    if (!dig_tex[6].loadFromFile("medias/7seg_6.png")) {std::cout << "Seven_seg_digit: error loading texture 6" << std::endl;};
-    if (!dig_tex[7].loadFromFile("medias/7seg_7.png")) {std::cout << "Seven_seg_digit: error loading texture 7" << std::endl;};
-    if (!dig_tex[8].loadFromFile("medias/7seg_8.png")) {std::cout << "Seven_seg_digit: error loading texture 8" << std::endl;};
-    if (!dig_tex[9].loadFromFile("medias/7seg_9.png")) {std::cout << "Seven_seg_digit: error loading texture 9" << std::endl;};
-    if (!dig_tex[10].loadFromFile("medias/7seg_off.png")) {std::cout << "Seven_seg_digit: error loading texture off" << std::endl;};
-    set_dig(10);
+// Segment bitmasks for 0-9 and off
+static const unsigned int seven_seg_font[11] {0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F, 0x00};
+
+// Geometry, in digit heights
+static const float seg_w {0.44};      // Digit width
+static const float seg_t {0.09};      // Segment thickness
+static const float seg_gap {0.012};   // Gap between segments
+static const float seg_skew {0.06};   // Italic slant
+static const float seg_dp_x {0.51};   // Decimal point and colon column
+
+// Segment endpoints: horizontal (0) or vertical (1), fixed coordinate, from, to
+static const float seg_lines[7][4] {
+    {0, seg_t/2, seg_t/2 + seg_gap, seg_w - seg_t/2 - seg_gap},        // a
+    {1, seg_w - seg_t/2, seg_t/2 + seg_gap, 0.5f - seg_gap},           // b
+    {1, seg_w - seg_t/2, 0.5f + seg_gap, 1 - seg_t/2 - seg_gap},       // c
+    {0, 1 - seg_t/2, seg_t/2 + seg_gap, seg_w - seg_t/2 - seg_gap},    // d
+    {1, seg_t/2, 0.5f + seg_gap, 1 - seg_t/2 - seg_gap},               // e
+    {1, seg_t/2, seg_t/2 + seg_gap, 0.5f - seg_gap},                   // f
+    {0, 0.5f, seg_t/2 + seg_gap, seg_w - seg_t/2 - seg_gap},           // g
+};
+
+// Append triangles of a convex polygon given in digit units
+static void seg_append(sf::VertexArray &va, const sf::Vector2<float> *p, int n, sf::Vector2<float> pos, sf::Vector2<float> size, sf::Color col) {
+    auto tf = [&](sf::Vector2<float> v) {
+        return sf::Vector2<float>(pos.x + (v.x + seg_skew * (1 - v.y)) * size.x, pos.y + v.y * size.y);
+    };
+    for (int i {1}; i < n - 1; i++) {
+        va.append(sf::Vertex(tf(p[0]), col));
+        va.append(sf::Vertex(tf(p[i]), col));
+        va.append(sf::Vertex(tf(p[i + 1]), col));
+    }
 }
+
+csl::Seven_seg_digit::Seven_seg_digit() {set_dig(10);}
+
+void csl::Seven_seg_digit::set_segments(unsigned int sin) {
+    if (sin != segments) dirty = 1;
+    segments = sin;
+}
+unsigned int csl::Seven_seg_digit::get_segments() const {return segments;}
+
 void csl::Seven_seg_digit::set_dig(int din) {
     if (din < 0) din = 0;
     else if (din > 10) din = 10;
-    dig_sprite.setTexture(dig_tex[din]);
+    set_segments((segments & (seg_dot | seg_colon)) | seven_seg_font[din]);
+}
+void csl::Seven_seg_digit::set_dot(int on) {
+    set_segments(on ? segments | seg_dot : segments & ~seg_dot);
 }
+void csl::Seven_seg_digit::set_colon(int on) {
+    set_segments(on ? segments | seg_colon : segments & ~seg_colon);
+}
+
+void csl::Seven_seg_digit::set_position(float x, float y) {
+    position = sf::Vector2<float>(x, y);
+    dirty = 1;
+}
+void csl::Seven_seg_digit::set_scale(float scalex, float scaley) {
+    scale = sf::Vector2<float>(scalex, scaley);
+    dirty = 1;
+}
+void csl::Seven_seg_digit::set_color(sf::Color on, sf::Color off) {
+    color_on = on;
+    color_off = off;
+    dirty = 1;
+}
+
+void csl::Seven_seg_digit::append_mesh(sf::VertexArray &va) const {
+    const sf::Vector2<float> size {height * scale.x, height * scale.y};
+    const float h {seg_t / 2};
+    for (int i {0}; i < 7; i++) {
+        const float *l {seg_lines[i]};
+        sf::Vector2<float> p[6];
+        if (l[0] == 0) { // Horizontal hexagon
+            p[0] = {l[2], l[1]};     p[1] = {l[2] + h, l[1] - h}; p[2] = {l[3] - h, l[1] - h};
+            p[3] = {l[3], l[1]};     p[4] = {l[3] - h, l[1] + h}; p[5] = {l[2] + h, l[1] + h};
+        } else { // Vertical hexagon
+            p[0] = {l[1], l[2]};     p[1] = {l[1] + h, l[2] + h}; p[2] = {l[1] + h, l[3] - h};
+            p[3] = {l[1], l[3]};     p[4] = {l[1] - h, l[3] - h}; p[5] = {l[1] - h, l[2] + h};
+        }
+        seg_append(va, p, 6, position, size, (segments & (1u << i)) ? color_on : color_off);
+    }
+    // Decimal point, always drawn (dim when off)
+    {
+        const sf::Vector2<float> p[4] {{seg_dp_x - h, 1 - seg_t}, {seg_dp_x + h, 1 - seg_t}, {seg_dp_x + h, 1}, {seg_dp_x - h, 1}};
+        seg_append(va, p, 4, position, size, (segments & seg_dot) ? color_on : color_off);
+    }
+    // Colon, only drawn when on
+    if (segments & seg_colon) {
+        for (const float y:{0.3f, 0.7f}) {
+            const sf::Vector2<float> p[4] {{seg_dp_x - h, y - h}, {seg_dp_x + h, y - h}, {seg_dp_x + h, y + h}, {seg_dp_x - h, y + h}};
+            seg_append(va, p, 4, position, size, color_on);
+        }
+    }
+}
+
 void csl::Seven_seg_digit::draw(sf::RenderWindow *win) {
-    win->draw(dig_sprite);
+    if (dirty) {
+        mesh.clear();
+        append_mesh(mesh);
+        dirty = 0;
+    }
+    win->draw(mesh);
 }
 int csl::Seven_seg_digit::operator = (int vin) {
     set_dig(vin);
@@ -135,37 +339,72 @@ int csl::Seven_seg_digit::operator = (int vin) {
 
 // ************* Seven Segment Display *************
 
-void csl::Seven_seg_display::draw(sf::RenderWindow *win) {for (auto i:seven_seg_digits) i->draw(win);}
+void csl::Seven_seg_display::draw(sf::RenderWindow *win) {
+    if (dirty) {
+        mesh.clear();
+        for (const auto &i:seven_seg_digits) i.append_mesh(mesh);
+        dirty = 0;
+    }
+    win->draw(mesh);
+}
 
-csl::Seven_seg_display::Seven_seg_display (unsigned int dig_count) {
-    for (auto i {0}; i < dig_count; i++) {
-        seven_seg_digits.emplace_back(std::make_shared<Seven_seg_digit>());
-        seven_seg_digits[i]->dig_sprite.setPosition(h_spacing*i, 0);
+csl::Seven_seg_display::Seven_seg_display (unsigned int dig_count): seven_seg_digits(dig_count) {
+    layout();
+}
+
+// Right to left from position, spacing follows scale
+void csl::Seven_seg_display::layout() {
+    int ix {0};
+    for (auto &i:seven_seg_digits) {
+        i.set_position(position.x - Seven_seg_digit::pitch * scale.x * ix++, position.y);
+        i.set_scale(scale.x, scale.y);
     }
+    dirty = 1;
 }
 
 void csl::Seven_seg_display::set_digit(int dig, int value) {
     if (dig < 0) dig = 0;
-    else if (dig >= seven_seg_digits.size()) dig = seven_seg_digits.size() - 1;
-    //seven_seg_digits[dig]->set_dig(value);
-    *seven_seg_digits[dig] = value;
+    else if (dig >= (int)seven_seg_digits.size()) dig = seven_seg_digits.size() - 1;
+    const unsigned int old {seven_seg_digits[dig].get_segments()};
+    seven_seg_digits[dig] = value;
+    if (seven_seg_digits[dig].get_segments() != old) dirty = 1;
 }
 
-void csl::Seven_seg_display::set_position (int x, int y) {
-    int ix {0};
-    for (auto i:seven_seg_digits) i->dig_sprite.setPosition(x - h_spacing * ix++, y);
+void csl::Seven_seg_display::set_dot(int dig, int on) {
+    if (dig < 0 || dig >= (int)seven_seg_digits.size()) return;
+    seven_seg_digits[dig].set_dot(on);
+    dirty = 1;
+}
+
+void csl::Seven_seg_display::set_colon(int dig, int on) {
+    if (dig < 0 || dig >= (int)seven_seg_digits.size()) return;
+    seven_seg_digits[dig].set_colon(on);
+    dirty = 1;
+}
+
+void csl::Seven_seg_display::set_position (float x, float y) {
+    position = sf::Vector2<float>(x, y);
+    layout();
 }
 
 void csl::Seven_seg_display::set_scale (const float scalex, const float scaley) {
-    for (auto i:seven_seg_digits) i->dig_sprite.setScale(scalex,scaley);
+    scale = sf::Vector2<float>(scalex, scaley);
+    layout();
 }
 
 void csl::Seven_seg_display::set_scale (const float scale) {set_scale(scale, scale);}
 
+void csl::Seven_seg_display::set_color (sf::Color on, sf::Color off) {
+    for (auto &i:seven_seg_digits) i.set_color(on, off);
+    dirty = 1;
+}
+
 int csl::Seven_seg_display::operator = (int vin) {
     unsigned int di {1}; // di = 1, 10, 100, ...
-    for (auto i:seven_seg_digits) {
-        *i = vin / di % 10; // Extract a digits: vin / {1, 10, 100, ...} % 10
+    for (auto &i:seven_seg_digits) {
+        const unsigned int old {i.get_segments()};
+        i = vin / di % 10; // Extract a digits: vin / {1, 10, 100, ...} % 10
+        if (i.get_segments() != old) dirty = 1;
         di *= 10;
     }
     return vin;
@@ -250,24 +489,42 @@ csl::Serial::Serial() {
 #define MOT_CMD_DIR_CW    9
 #define MOT_CMD_GO_SLOW   10
 #define MOT_CMD_HOLD_POS  11
+#define MOT_CMD_RAMP_UP   12
+#define MOT_CMD_RAMP_DOWN 13
+
+void csl::Serial::non_blocking_write(int vin, int timed) {
+    char c {0};
+    if (vin == MOT_CMD_RUN) c = 'r';
+    else if (vin == MOT_CMD_SLEEP) c = 's';
+    else if (vin == MOT_CMD_PAUSE) c = '=';
+    else if (vin == MOT_CMD_MODE_AUTO) c = 'a';
+    else if (vin == MOT_CMD_MODE_MAN) c = 'm';
+    else if (vin == MOT_CMD_SPD_PLUS) c = '+';
+    else if (vin == MOT_CMD_SPD_MINUS) c = '-';
+    else if (vin == MOT_CMD_DIR_CCW) c = '<';
+    else if (vin == MOT_CMD_DIR_CW) c = '>';
+    else if (vin == MOT_CMD_GO_SLOW) c = 'g';
+    else if (vin == MOT_CMD_HOLD_POS) c = 'P';
+    else if (vin == MOT_CMD_RAMP_UP) c = 'u';   // Outside 0-9 A-F, a stray table byte can't start a ramp
+    else if (vin == MOT_CMD_RAMP_DOWN) c = 'd';
+    if (!c) return;
 
-void csl::Serial::non_blocking_write(int vin) {
-    int wr = 0;
+    std::lock_guard<std::mutex> l {write_lock};
+    if (recorder) recorder->serial_tx(&c, 1, timed);
+    if (player) {
+        player->serial_write(&c, 1, timed);
+        return;
+    }
+    int wr = write(fd, &c, 1);
     (void)wr;
-    if (vin == MOT_CMD_RUN) wr = write(fd, "r", 1);
-    else if (vin == MOT_CMD_SLEEP) wr = write(fd, "s", 1);
-    else if (vin == MOT_CMD_PAUSE) wr = write(fd, "=", 1);
-    else if (vin == MOT_CMD_MODE_AUTO) wr = write(fd, "a", 1);
-    else if (vin == MOT_CMD_MODE_MAN) wr = write(fd, "m", 1);
-    else if (vin == MOT_CMD_SPD_PLUS) wr = write(fd, "+", 1);
-    else if (vin == MOT_CMD_SPD_MINUS) wr = write(fd, "-", 1);
-    else if (vin == MOT_CMD_DIR_CCW) wr = write(fd, "<", 1);
-    else if (vin == MOT_CMD_DIR_CW) wr = write(fd, ">", 1);
-    else if (vin == MOT_CMD_GO_SLOW) wr = write(fd, "g", 1);
-    else if (vin == MOT_CMD_HOLD_POS) wr = write(fd, "P", 1);
-}
-
-std::string csl::Serial::blocking_read() {
+}
+
+const std::string &csl::Serial::blocking_read() {
+    str_out.clear();
+    if (player) {
+        player->serial_read(str_out);
+        return str_out;
+    }
     if (fd>0) {
         char buf[512] = {0};
         int buf_s = 0;
@@ -281,22 +538,1001 @@ std::string csl::Serial::blocking_read() {
         // printf("%s", buf);
         // fflush(stdout);
         if (buf_s > 0) {
-          str_out = std::string(buf, buf_s);
+          str_out.assign(buf, buf_s);
           // cout << "str_out " << str_out << " buf_s " << buf_s << endl;
           // cout << str_out << flush;
-          return str_out;
-        } else {
-          return "";
+          if (recorder) recorder->serial_rx(str_out);
         }
     } else {
         printf("fd not open\r");
-        return "";
     }
+    return str_out;
 }
 
+int csl::Serial::write_bytes(const char *data, size_t size) {
+    std::lock_guard<std::mutex> l {write_lock};
+    if (recorder) recorder->serial_tx(data, size);
+    if (player) {
+        player->serial_write(data, size);
+        return size;
+    }
+    if (fd <= 0) return 0;
+    size_t done {0};
+    while (done < size) {
+        const ssize_t wr {write(fd, data + done, size - done)};
+        if (wr > 0) done += wr;
+        else if (wr < 0 && errno == EINTR) continue;
+        else if (wr < 0 && errno == EAGAIN) {
+            // Output buffer full, wait for the UART to drain
+            pollfd pfd {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, 100) <= 0) break;
+        } else break;
+    }
+    if (done < size) printf("Serial: bulk write incomplete (%zu / %zu)\n", done, size);
+    return done;
+}
+
+void csl::Serial::set_recorder(Session_recorder *r) {recorder = r;}
+void csl::Serial::set_player(Session_player *p) {player = p;}
+
 csl::Serial::~Serial() {if (fd) close(fd);}
 
 
+// ************* Session record / replay *************
+
+static const char rec_magic[6] {'C', 'S', 'L', 'R', 'E', 'C'};
+static const unsigned char rec_version {2}; // 1 had no rec_serial_tx_timed, still readable
+
+int csl::Session_recorder::open(const std::string &path) {
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cout << "Session_recorder: can't open " << path << std::endl;
+        return 0;
+    }
+    const unsigned char hdr[2] {rec_version, sizeof(sf::Event)};
+    file.write(rec_magic, sizeof(rec_magic));
+    file.write(reinterpret_cast<const char *>(hdr), sizeof(hdr));
+    return 1;
+}
+
+int csl::Session_recorder::is_open() {return file.is_open();}
+
+void csl::Session_recorder::write_bytes(unsigned char type, const char *data, size_t size) {
+    std::lock_guard<std::mutex> l {lock};
+    if (!file.is_open()) return;
+    const uint32_t sz = size;
+    file.put(type);
+    file.write(reinterpret_cast<const char *>(&sz), sizeof(sz));
+    file.write(data, size);
+}
+
+// Flushed per frame, a crash or kill loses at most the frame in progress
+void csl::Session_recorder::frame(sf::Time now) {
+    std::lock_guard<std::mutex> l {lock};
+    if (!file.is_open()) return;
+    const uint64_t t = now.asMicroseconds();
+    file.put(rec_frame);
+    file.write(reinterpret_cast<const char *>(&t), sizeof(t));
+    file.flush();
+}
+
+void csl::Session_recorder::event(const sf::Event &ev) {
+    std::lock_guard<std::mutex> l {lock};
+    if (!file.is_open()) return;
+    file.put(rec_event);
+    file.write(reinterpret_cast<const char *>(&ev), sizeof(ev));
+}
+
+void csl::Session_recorder::serial_rx(const std::string &str) {write_bytes(rec_serial_rx, str.data(), str.size());}
+void csl::Session_recorder::serial_tx(const char *data, size_t size, int timed) {
+    write_bytes(timed ? rec_serial_tx_timed : rec_serial_tx, data, size);
+}
+
+void csl::Session_recorder::close() {
+    std::lock_guard<std::mutex> l {lock};
+    if (file.is_open()) file.close();
+}
+
+
+int csl::Session_player::open(const std::string &path, int as_fast_as_possible) {
+    file.open(path, std::ios::binary);
+    if (!file) {
+        std::cout << "Session_player: can't open " << path << std::endl;
+        return 0;
+    }
+    char magic[sizeof(rec_magic)];
+    unsigned char hdr[2];
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char *>(hdr), sizeof(hdr));
+    if (!file || memcmp(magic, rec_magic, sizeof(magic)) || hdr[0] < 1 || hdr[0] > rec_version || hdr[1] != sizeof(sf::Event)) {
+        std::cout << "Session_player: " << path << " is not a recording from this build" << std::endl;
+        file.close();
+        return 0;
+    }
+    fast = as_fast_as_possible;
+    // First record is the first frame mark
+    uint64_t t {0};
+    has_next = file.get() == Session_recorder::rec_frame && file.read(reinterpret_cast<char *>(&t), sizeof(t));
+    next_time = sf::microseconds(t);
+    clock.restart();
+    return 1;
+}
+
+int csl::Session_player::is_open() {return file.is_open();}
+
+void csl::Session_player::mismatch(const char *when, std::string &actual, std::string &expected) {
+    tx_mismatches++;
+    std::cout << "Session_player: " << when << " sent \"" << actual << "\", recorded \"" << expected << "\"" << std::endl;
+    actual.clear();
+    expected.clear();
+}
+
+// Main loop output must match frame by frame. Scheduler output is a stream
+// of its own: live, it may have landed in later frames than on replay,
+// where ramps run in the frame that asked. What both sides sent is
+// dropped, the rest waits for the next frames.
+void csl::Session_player::check_tx() {
+    const std::string when {"frame " + std::to_string(frames)};
+    if (tx_actual != tx_expected) mismatch(when.c_str(), tx_actual, tx_expected);
+    tx_actual.clear();
+    tx_expected.clear();
+
+    const size_t n {std::min(timed_actual.size(), timed_expected.size())};
+    if (timed_actual.compare(0, n, timed_expected, 0, n)) {
+        mismatch((when + " (timed)").c_str(), timed_actual, timed_expected);
+        return;
+    }
+    timed_actual.erase(0, n);
+    timed_expected.erase(0, n);
+}
+
+int csl::Session_player::next_frame() {
+    if (frames) check_tx();
+    if (!has_next) {
+        if (timed_actual.size() || timed_expected.size()) mismatch("at end (timed)", timed_actual, timed_expected);
+        return 0;
+    }
+    if (!fast) {
+        const sf::Time wait {next_time - clock.getElapsedTime()};
+        if (wait > sf::Time::Zero) sf::sleep(wait);
+    }
+    events.clear();
+    event_ix = 0;
+    rx.clear();
+    has_next = 0;
+    frame_time = next_time;
+    frames++;
+
+    int type;
+    while ((type = file.get()) != EOF) {
+        if (type == Session_recorder::rec_frame) {
+            uint64_t t {0};
+            if (file.read(reinterpret_cast<char *>(&t), sizeof(t))) {
+                next_time = sf::microseconds(t);
+                has_next = 1;
+            }
+            break;
+        } else if (type == Session_recorder::rec_event) {
+            sf::Event ev;
+            if (!file.read(reinterpret_cast<char *>(&ev), sizeof(ev))) break;
+            events.push_back(ev);
+        } else if (type == Session_recorder::rec_serial_rx || type == Session_recorder::rec_serial_tx ||
+                   type == Session_recorder::rec_serial_tx_timed) {
+            uint32_t sz {0};
+            if (!file.read(reinterpret_cast<char *>(&sz), sizeof(sz))) break;
+            std::string &dst {type == Session_recorder::rec_serial_rx ? rx :
+                              type == Session_recorder::rec_serial_tx ? tx_expected : timed_expected};
+            const size_t at {dst.size()};
+            dst.resize(at + sz);
+            if (!file.read(&dst[at], sz)) break;
+        } else {
+            std::cout << "Session_player: corrupted record" << std::endl;
+            break;
+        }
+    }
+    return 1;
+}
+
+sf::Time csl::Session_player::get_frame_time() {return frame_time;}
+
+int csl::Session_player::poll_event(sf::Event &ev) {
+    if (event_ix >= events.size()) return 0;
+    ev = events[event_ix++];
+    return 1;
+}
+
+void csl::Session_player::serial_read(std::string &str) {
+    str.assign(rx);
+    rx.clear();
+}
+
+void csl::Session_player::serial_write(const char *data, size_t size, int timed) {
+    (timed ? timed_actual : tx_actual).append(data, size);
+}
+
+unsigned long csl::Session_player::get_tx_mismatches() {return tx_mismatches;}
+
+void csl::Session_player::report() {
+    std::cout << "Replay: " << frames << " frames in " << clock.getElapsedTime().asSeconds() << " s, "
+              << tx_mismatches << " frames with diverging serial output" << std::endl;
+}
+
+
+
+// ************* Real-time *************
+
+int csl::Realtime::apply() {
+    int ok {1};
+    if (cpu >= 0) {
+        #ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        const int err {pthread_setaffinity_np(pthread_self(), sizeof(set), &set)};
+        if (err) {printf("Realtime: CPU %d affinity failed: %s\n", cpu, strerror(err)); ok = 0;}
+        #else
+        printf("Realtime: CPU affinity not supported\n");
+        ok = 0;
+        #endif
+    }
+    if (fifo_priority > 0) {
+        #ifdef __linux__
+        sched_param sp {};
+        sp.sched_priority = fifo_priority;
+        const int err {pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)};
+        if (err) {printf("Realtime: SCHED_FIFO %d failed: %s\n", fifo_priority, strerror(err)); ok = 0;}
+        #else
+        printf("Realtime: SCHED_FIFO not supported\n");
+        ok = 0;
+        #endif
+    }
+    if (lock_memory) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE)) {perror("Realtime: mlockall failed"); ok = 0;}
+    }
+    return ok;
+}
+
+
+// ************* Jitter probe *************
+
+csl::Jitter_probe::Jitter_probe(size_t capacity): late_ns(capacity > 0 ? capacity : 1) {}
+
+void csl::Jitter_probe::record(const timespec &scheduled, const timespec &actual) {
+    const int64_t late {(int64_t)(actual.tv_sec - scheduled.tv_sec) * 1000000000 + (actual.tv_nsec - scheduled.tv_nsec)};
+    late_ns[total % late_ns.size()] = late;
+    total++;
+    if (count < late_ns.size()) count++;
+}
+
+void csl::Jitter_probe::reset() {count = total = 0;}
+
+void csl::Jitter_probe::report(const char *name) {
+    if (!count) {
+        printf("Jitter %s: no samples\n", name);
+        return;
+    }
+    std::vector<int64_t> v(late_ns.begin(), late_ns.begin() + count);
+    std::sort(v.begin(), v.end());
+    int64_t sum {0};
+    for (auto i:v) sum += i;
+    printf("Jitter %s: %zu releases, late (us) min %.1f mean %.1f p99 %.1f max %.1f\n", name, total,
+           v.front() / 1e3, sum / 1e3 / count, v[(count - 1) * 99 / 100] / 1e3, v.back() / 1e3);
+}
+
+
+// ************* Scheduler *************
+
+csl::Scheduler::Scheduler(Serial &s): serial(s) {}
+csl::Scheduler::~Scheduler() {stop();}
+
+void csl::Scheduler::set_probe(Jitter_probe *p) {probe = p;}
+void csl::Scheduler::set_timed(int t) {timed = t;}
+
+void csl::Scheduler::start(Realtime rt) {
+    if (worker.joinable()) return;
+    stopping = 0;
+    worker = std::thread([this, rt]() mutable {
+        if (!rt.apply()) std::cout << "Real-time settings not fully applied" << std::endl;
+        std::unique_lock<std::mutex> l {lock};
+        while (1) {
+            wake.wait(l, [this]() {return stopping || jobs.size();});
+            if (jobs.empty()) break; // Stopping, queue drained
+            const Job job {jobs.front()};
+            jobs.pop_front();
+            l.unlock();
+            run(job);
+            l.lock();
+        }
+    });
+}
+
+void csl::Scheduler::stop() {
+    if (!worker.joinable()) return;
+    {
+        std::lock_guard<std::mutex> l {lock};
+        stopping = 1;
+    }
+    wake.notify_one();
+    worker.join();
+}
+
+timespec csl::Scheduler::now() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t;
+}
+
+void csl::Scheduler::sleep_until(const timespec &deadline) {
+    #ifdef __linux__
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR);
+    #else
+    // No absolute sleep, relative to now
+    const timespec t {now()};
+    timespec dt {deadline.tv_sec - t.tv_sec, deadline.tv_nsec - t.tv_nsec};
+    if (dt.tv_nsec < 0) {dt.tv_sec--; dt.tv_nsec += 1000000000;}
+    if (dt.tv_sec >= 0) nanosleep(&dt, nullptr);
+    #endif
+}
+
+void csl::Scheduler::ramp(int cmd, unsigned int steps, unsigned int dt_ms) {
+    if (!worker.joinable()) {
+        run(Job {cmd, steps, dt_ms});
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> l {lock};
+        jobs.push_back(Job {cmd, steps, dt_ms});
+    }
+    wake.notify_one();
+}
+
+void csl::Scheduler::run(const Job &job) {
+    timespec deadline {now()};
+    for (unsigned int i {0}; i < job.steps; i++) {
+        if (timed) {
+            deadline.tv_nsec += (long)job.dt_ms * 1000000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            sleep_until(deadline);
+            if (probe) probe->record(deadline, now());
+        }
+        serial.non_blocking_write(job.cmd, 1);
+    }
+}
+
+
+
+// ************* Ramp tables *************
+
+csl::Ramp_table::Ramp_table(Profile profile, unsigned int steps, unsigned int res, int decelerate) {
+    build(profile, steps, res, decelerate);
+}
+
+void csl::Ramp_table::build(Profile profile, unsigned int steps, unsigned int res, int decelerate) {
+    if (steps < 2) steps = 2;
+    else if (steps > 65535) steps = 65535;
+    resolution = res < 1 ? 1 : res > 16 ? 16 : res;
+    const double full {(double)((1u << resolution) - 1)};
+    entries.resize(steps);
+    for (unsigned int i {0}; i < steps; i++) {
+        const double t {(double)i / (steps - 1)};
+        double v {t};                                       // Constant acceleration
+        if (profile == s_curve) v = (1 - std::cos(M_PI * t)) / 2; // Zero acceleration at both ends
+        if (decelerate) v = 1 - v;
+        entries[i] = std::lround(v * full);
+    }
+}
+
+std::string csl::Ramp_table::encode(unsigned char id) const {
+    std::vector<unsigned char> p;
+    p.reserve(10 + 2 * entries.size());
+    auto u16 = [&p](unsigned int v) {
+        p.push_back(v & 0xFF);
+        p.push_back((v >> 8) & 0xFF);
+    };
+    p.push_back(id);
+    u16(entries.size());
+    p.push_back(resolution);
+    u16(step_us > 65535 ? 65535 : step_us);
+    u16(speed_delta > 65535 ? 65535 : speed_delta);
+    for (auto i:entries) u16(i);
+    unsigned char sum {0};
+    for (auto i:p) sum += i;
+    p.push_back(sum);
+
+    static const char hex[] {"0123456789ABCDEF"};
+    std::string f;
+    f.reserve(2 + 2 * p.size());
+    f += 'T';
+    for (auto i:p) {
+        f += hex[i >> 4];
+        f += hex[i & 0xF];
+    }
+    f += '\n';
+    return f;
+}
+
+std::string csl::Ramp_table::ack(unsigned char id) {return "T" + std::to_string(id) + "OK";}
+
+
+// ************* Telemetry *************
+
+csl::Telemetry::Telemetry(int count, double microsteps_per_unit) {
+    axis_count = count < 1 ? 1 : count > max_axes ? max_axes : count;
+    for (int i {0}; i < max_axes; i++) microsteps[i] = microsteps_per_unit;
+}
+
+int csl::Telemetry::get_axis_count() {return axis_count;}
+
+// Start of the readback text ending at end: [axis letter] [-] digits, after
+// a separator (CR, LF, cycle mark...). npos when it isn't one ("1x2")
+size_t csl::Telemetry::readback_start(const std::string &s, size_t end) {
+    size_t i {end};
+    while (i > 0 && s[i - 1] >= '0' && s[i - 1] <= '9') i--;
+    if (i > 0 && s[i - 1] == '-') i--;
+    if (i > 0 && s[i - 1] && strchr(axis_names, s[i - 1])) i--;
+    if (i > 0 && (isalnum((unsigned char)s[i - 1]) || s[i - 1] == '-')) return std::string::npos;
+    return i;
+}
+
+int csl::Telemetry::parse(const std::string &str) {
+    const std::string s {partial + str};
+    const std::string delimiter {">="};
+    int n {0};
+    size_t from {0}, pos_l {0};
+    while ((pos_l = s.find(delimiter, from)) != std::string::npos) {
+        size_t i {readback_start(s, pos_l)};
+        from = pos_l + delimiter.length();
+        if (i == std::string::npos) continue;
+        int axis {0};
+        const char *an {strchr(axis_names, s[i])};
+        if (an && s[i] != '>') {
+            axis = an - axis_names;
+            i++;
+        }
+        const size_t digits {s[i] == '-' ? i + 1 : i};
+        if (digits >= pos_l || axis >= axis_count) continue;
+        steps[axis] = strtol(&s[i], nullptr, 10);
+        flags[axis] |= flag_updated;
+        n++;
+    }
+    // Keep an unterminated readback (possibly with half the delimiter) for
+    // the next chunk, drop anything else
+    size_t end {s.size()};
+    if (end > from && s[end - 1] == '>') end--;
+    const size_t start {readback_start(s, end)};
+    if (start == std::string::npos || start < from || s.size() - start > 16) partial.clear();
+    else partial = s.substr(start);
+    return n;
+}
+
+int csl::Telemetry::update(sf::Time dt) {
+    const double dts {dt.asSeconds()};
+    int n {0};
+    for (int i {0}; i < max_axes; i++) age[i] += dts;
+    for (int i {0}; i < max_axes; i++) {
+        const double p {steps[i] / microsteps[i]};
+        const bool upd {(flags[i] & flag_updated) != 0};
+        const bool dv {upd && (flags[i] & flag_seen) && age[i] > 0};
+        velocity[i] = dv ? (p - position[i]) / age[i] : velocity[i];
+        position[i] = upd ? p : position[i];
+        age[i] = upd ? 0 : age[i];
+        flags[i] = upd ? (flags[i] | flag_seen) & ~flag_updated : flags[i];
+        n += upd;
+    }
+    return n;
+}
+
+void csl::Telemetry::log(std::ostream &os) {
+    for (int i {0}; i < axis_count; i++) {
+        if (!(flags[i] & flag_seen)) continue;
+        os << axis_names[i] << " " << position[i] << " (" << velocity[i] << "/s) ";
+    }
+    os << std::endl;
+}
+
+
+// ************* Toolpath view *************
+
+csl::Toolpath_view::Toolpath_view() {
+    sf::Image img;
+    img.create(1, 1, sf::Color(60, 110, 200));
+    tex_pending.loadFromImage(img);
+    img.create(1, 1, sf::Color(40, 200, 60));
+    tex_done.loadFromImage(img);
+}
+
+static sf::FloatRect rect_union(const sf::FloatRect &a, const sf::FloatRect &b) {
+    const float l {std::min(a.left, b.left)}, t {std::min(a.top, b.top)};
+    const float r {std::max(a.left + a.width, b.left + b.width)}, d {std::max(a.top + a.height, b.top + b.height)};
+    return sf::FloatRect(l, t, r - l, d - t);
+}
+
+// Balanced tree over consecutive chunks, path locality keeps boxes tight
+int csl::Toolpath_view::build_node(int first, int last) {
+    Node n;
+    n.left = n.right = n.chunk = -1;
+    if (first == last) {
+        n.chunk = first;
+        n.bounds = chunks[first].bounds;
+    } else {
+        const int mid {(first + last) / 2};
+        n.left = build_node(first, mid);
+        n.right = build_node(mid + 1, last);
+        n.bounds = rect_union(nodes[n.left].bounds, nodes[n.right].bounds);
+    }
+    nodes.push_back(n);
+    return nodes.size() - 1;
+}
+
+void csl::Toolpath_view::set_path(const std::vector<sf::Vector2<float>> &path) {
+    points = path;
+    chunks.clear();
+    nodes.clear();
+    executed = 0;
+    if (points.size() < 2) return;
+    if (!sf::VertexBuffer::isAvailable()) {
+        std::cout << "Toolpath_view: vertex buffers not available" << std::endl;
+        return;
+    }
+
+    const size_t seg_count {points.size() - 1};
+    chunks.reserve((seg_count + chunk_size - 2) / (chunk_size - 1));
+    std::vector<sf::Vertex> v;
+    v.reserve(chunk_size);
+    for (size_t first {0}; first < seg_count; first += chunk_size - 1) {
+        Chunk c;
+        c.first = first;
+        c.count = std::min(chunk_size, points.size() - first);
+
+        // Bounds (slightly grown so flat boxes still intersect) and mean segment length
+        float l {points[first].x}, t {points[first].y}, r {l}, d {t}, len {0};
+        for (size_t i {first + 1}; i < first + c.count; i++) {
+            l = std::min(l, points[i].x); r = std::max(r, points[i].x);
+            t = std::min(t, points[i].y); d = std::max(d, points[i].y);
+            len += std::hypot(points[i].x - points[i - 1].x, points[i].y - points[i - 1].y);
+        }
+        c.bounds = sf::FloatRect(l - 1e-3f, t - 1e-3f, r - l + 2e-3f, d - t + 2e-3f);
+        c.seg_len = len / (c.count - 1);
+
+        // Level k keeps every 2^k th vertex, and always the last one
+        c.lod.reserve(lod_levels);
+        for (int k {0}; k < lod_levels; k++) {
+            const size_t stride {(size_t)1 << k};
+            if (k && (c.count - 1) / stride < 2) break;
+            v.clear();
+            for (size_t i {0}; i < c.count - 1; i += stride) v.emplace_back(points[first + i], sf::Color::White, sf::Vector2<float>(0.5, 0.5));
+            v.emplace_back(points[first + c.count - 1], sf::Color::White, sf::Vector2<float>(0.5, 0.5));
+            c.lod.emplace_back(sf::LineStrip, sf::VertexBuffer::Static);
+            c.lod.back().create(v.size());
+            c.lod.back().update(v.data());
+            c.lod_count.push_back(v.size());
+        }
+        chunks.push_back(std::move(c));
+    }
+
+    bounds = chunks[0].bounds;
+    for (const auto &i:chunks) bounds = rect_union(bounds, i.bounds);
+    nodes.reserve(2 * chunks.size());
+    build_node(0, chunks.size() - 1);
+}
+
+// Arc from (x, y) to (ex, ey) around c, intermediate points only (5 degree steps)
+static void arc_points(std::vector<sf::Vector2<float>> &pts, double x, double y, double ex, double ey,
+                       double cx, double cy, int clockwise) {
+    const double r0 {std::hypot(x - cx, y - cy)}, r1 {std::hypot(ex - cx, ey - cy)};
+    if (r0 <= 0 || r1 <= 0) return;
+    const double a0 {std::atan2(y - cy, x - cx)};
+    double sweep {std::atan2(ey - cy, ex - cx) - a0};
+    const int full {std::hypot(ex - x, ey - y) < 1e-6};
+    if (clockwise) {
+        if (sweep >= 0 || full) sweep -= 2 * M_PI;
+    } else if (sweep <= 0 || full) sweep += 2 * M_PI;
+    const int n {(int)std::ceil(std::fabs(sweep) / (M_PI / 36))};
+    for (int k {1}; k < n; k++) {
+        const double a {a0 + sweep * k / n}, r {r0 + (r1 - r0) * k / n};
+        pts.emplace_back(cx + r * std::cos(a), cy + r * std::sin(a));
+    }
+}
+
+int csl::Toolpath_view::load_gcode(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cout << "Toolpath_view: can't open " << path << std::endl;
+        return 0;
+    }
+    set_path(parse_gcode(file));
+    return 1;
+}
+
+std::vector<sf::Vector2<float>> csl::Toolpath_view::parse_gcode(std::istream &file) {
+    std::vector<sf::Vector2<float>> pts;
+    double x {0}, y {0};
+    int motion {-1}, relative {0}, arc_absolute {0};
+    std::string line;
+    pts.emplace_back(x, y);
+    while (std::getline(file, line)) {
+        // Strip ; and ( ) comments
+        std::string s;
+        int paren {0};
+        for (auto i:line) {
+            if (i == ';') break;
+            else if (i == '(') paren = 1;
+            else if (i == ')') paren = 0;
+            else if (!paren) s += toupper(i);
+        }
+        double wx {0}, wy {0}, wi {0}, wj {0}, wr {0};
+        int has_x {0}, has_y {0}, has_i {0}, has_j {0}, has_r {0}, not_a_move {0};
+        for (size_t i {0}; i < s.size(); i++) {
+            const char w {s[i]};
+            if (w < 'A' || w > 'Z') continue;
+            // Sign, digits and '.' only: no hex or exponent, "G0X10" is G0 X10
+            const char *b {s.data() + i + 1}, *e {s.data() + s.size()};
+            if (b < e && *b == '+') b++;
+            double val;
+            const auto r {std::from_chars(b, e, val, std::chars_format::fixed)};
+            if (r.ec != std::errc()) continue;
+            i = r.ptr - s.data() - 1;
+            if (w == 'G') {
+                // Whole value, G90.1 isn't G90
+                if (val == 0 || val == 1 || val == 2 || val == 3) motion = val;
+                else if (val == 90) relative = 0;
+                else if (val == 91) relative = 1;
+                else if (val == 90.1) arc_absolute = 1;
+                else if (val == 91.1) arc_absolute = 0;
+                // Dwell, offsets, home, machine coordinates: X Y aren't a move in program coordinates
+                else if (val == 4 || val == 10 || val == 28 || val == 30 || val == 53 || val == 92) not_a_move = 1;
+            }
+            else if (w == 'X') {wx = val; has_x = 1;}
+            else if (w == 'Y') {wy = val; has_y = 1;}
+            else if (w == 'I') {wi = val; has_i = 1;}
+            else if (w == 'J') {wj = val; has_j = 1;}
+            else if (w == 'R') {wr = val; has_r = 1;}
+        }
+        const int arc {motion == 2 || motion == 3};
+        if (not_a_move || motion < 0) continue;
+        if (!has_x && !has_y && !(arc && (has_i || has_j))) continue; // Full circle has I/J only
+        const double ex {has_x ? (relative ? x + wx : wx) : x};
+        const double ey {has_y ? (relative ? y + wy : wy) : y};
+        if (arc && has_r) {
+            // Centre on the chord bisector, left of travel for G3, right for G2, other side when R < 0
+            const double dx {ex - x}, dy {ey - y}, d {std::hypot(dx, dy)};
+            if (d > 0) {
+                const double h {std::sqrt(std::max(0.0, wr * wr - d * d / 4))};
+                const double side {(motion == 2) == (wr > 0) ? 1.0 : -1.0};
+                arc_points(pts, x, y, ex, ey, (x + ex) / 2 + side * h * dy / d, (y + ey) / 2 - side * h * dx / d, motion == 2);
+            }
+        } else if (arc) {
+            const double cx {arc_absolute ? (has_i ? wi : x) : x + wi};
+            const double cy {arc_absolute ? (has_j ? wj : y) : y + wj};
+            arc_points(pts, x, y, ex, ey, cx, cy, motion == 2);
+        }
+        x = ex;
+        y = ey;
+        pts.emplace_back(x, y);
+    }
+    return pts;
+}
+
+void csl::Toolpath_view::set_viewport(const sf::FloatRect &vp) {view.setViewport(vp);}
+
+void csl::Toolpath_view::fit(float aspect) {
+    if (chunks.empty() || aspect <= 0) return;
+    float w {bounds.width * 1.05f}, h {bounds.height * 1.05f};
+    if (w / h > aspect) h = w / aspect;
+    else w = h * aspect;
+    view.setCenter(bounds.left + bounds.width / 2, bounds.top + bounds.height / 2);
+    view.setSize(w, -h); // Y up
+}
+
+void csl::Toolpath_view::zoom(float factor) {view.zoom(factor);}
+
+void csl::Toolpath_view::set_position(sf::Vector2<float> p) {
+    if (points.empty()) return;
+    auto dist2 = [&](size_t i) {
+        const float dx {points[i].x - p.x}, dy {points[i].y - p.y};
+        return dx * dx + dy * dy;
+    };
+    const size_t last {std::min(points.size() - 1, executed + track_window)};
+    size_t best {executed};
+    float best_d {dist2(executed)};
+    for (size_t i {executed + 1}; i <= last; i++) {
+        const float d {dist2(i)};
+        if (d < best_d) {best_d = d; best = i;}
+    }
+    executed = best;
+}
+
+size_t csl::Toolpath_view::get_executed() {return executed;}
+size_t csl::Toolpath_view::get_size() {return points.size();}
+
+void csl::Toolpath_view::draw_chunk(sf::RenderTarget &target, sf::RenderStates states, const Chunk &c, float px_size) const {
+    // Coarsest level whose segments stay about 2 pixels long
+    int k {0};
+    if (c.seg_len > 0) k = std::floor(std::log2(2 * px_size / c.seg_len));
+    k = std::max(0, std::min(k, (int)c.lod.size() - 1));
+    const size_t n {c.lod_count[k]};
+
+    // Executed vertices of this chunk, in level k vertices
+    size_t done {0};
+    if (executed >= c.first + c.count - 1) done = n;
+    else if (executed > c.first) done = std::min(n - 1, ((executed - c.first) >> k) + 1);
+
+    if (done) {
+        states.texture = &tex_done;
+        target.draw(c.lod[k], 0, done, states);
+    }
+    if (done < n) {
+        const size_t from {done ? done - 1 : 0};
+        states.texture = &tex_pending;
+        target.draw(c.lod[k], from, n - from, states);
+    }
+}
+
+void csl::Toolpath_view::draw(sf::RenderTarget& target, sf::RenderStates states) const {
+    if (nodes.empty()) return;
+    const sf::View old {target.getView()};
+    target.setView(view);
+
+    const sf::IntRect vp {target.getViewport(view)};
+    const float px_size {vp.width > 0 ? std::abs(view.getSize().x) / vp.width : 1};
+    const sf::Vector2<float> c {view.getCenter()}, sz {std::abs(view.getSize().x), std::abs(view.getSize().y)};
+    const sf::FloatRect visible {c.x - sz.x / 2, c.y - sz.y / 2, sz.x, sz.y};
+
+    int stack[64]; // Balanced tree, depth ~ log2(chunks)
+    int sp {0};
+    stack[sp++] = nodes.size() - 1; // Root is built last
+    while (sp) {
+        const Node &n {nodes[stack[--sp]]};
+        if (!n.bounds.intersects(visible)) continue;
+        if (n.chunk >= 0) draw_chunk(target, states, chunks[n.chunk], px_size);
+        else {
+            stack[sp++] = n.left;
+            stack[sp++] = n.right;
+        }
+    }
+    target.setView(old);
+}
+
+
+// ************* Shared state *************
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "State_block needs lock-free 64 bit atomics");
+
+int csl::State_publisher::open(const std::string &shm_name) {
+    fd = shm_open(shm_name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {perror("State_publisher: shm_open"); return 0;}
+    void *p {MAP_FAILED};
+    if (ftruncate(fd, sizeof(State_block))) perror("State_publisher: ftruncate");
+    else if ((p = mmap(nullptr, sizeof(State_block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) perror("State_publisher: mmap");
+    if (p == MAP_FAILED) {
+        close(fd);
+        fd = -1;
+        return 0;
+    }
+    block = static_cast<State_block *>(p);
+    // A writer killed mid publish leaves the count odd, readers would spin on it
+    const uint64_t seq {block->seq.load(std::memory_order_relaxed)};
+    block->seq.store((seq + 1) & ~(uint64_t)1, std::memory_order_release);
+    name = shm_name;
+    return 1;
+}
+
+int csl::State_publisher::is_open() {return block != nullptr;}
+
+void csl::State_publisher::publish(State &st) {
+    if (!block) return;
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    st.layout = state_layout;
+    st.frame = ++frame;
+    st.time_ns = (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+
+    uint64_t w[sizeof(block->words) / 8] {};
+    memcpy(w, &st, sizeof(st));
+    const uint64_t seq {block->seq.load(std::memory_order_relaxed)};
+    block->seq.store(seq + 1, std::memory_order_relaxed); // Odd, readers retry
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i {0}; i < sizeof(w) / 8; i++) block->words[i].store(w[i], std::memory_order_relaxed);
+    block->seq.store(seq + 2, std::memory_order_release);
+}
+
+csl::State_publisher::~State_publisher() {
+    if (block) munmap(block, sizeof(State_block));
+    if (fd >= 0) close(fd);
+    if (name.size()) shm_unlink(name.c_str());
+}
+
+int csl::State_reader::open(const std::string &shm_name) {
+    fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {perror("State_reader: shm_open"); return 0;}
+    // Mapping past the end of a smaller segment would fault on read
+    struct stat st;
+    void *p {MAP_FAILED};
+    if (fstat(fd, &st)) perror("State_reader: fstat");
+    else if ((size_t)st.st_size < sizeof(State_block)) printf("State_reader: %s is %lld bytes, expected %zu\n", shm_name.c_str(), (long long)st.st_size, sizeof(State_block));
+    else if ((p = mmap(nullptr, sizeof(State_block), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) perror("State_reader: mmap");
+    if (p == MAP_FAILED) {
+        close(fd);
+        fd = -1;
+        return 0;
+    }
+    block = static_cast<const State_block *>(p);
+    return 1;
+}
+
+int csl::State_reader::read(State &st, int max_tries) {
+    if (!block) return 0;
+    uint64_t w[sizeof(block->words) / 8];
+    for (int n {0}; n < max_tries; n++) {
+        const uint64_t s0 {block->seq.load(std::memory_order_acquire)};
+        if (s0 & 1) continue;
+        for (size_t i {0}; i < sizeof(w) / 8; i++) w[i] = block->words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (block->seq.load(std::memory_order_relaxed) != s0) continue;
+        memcpy(&st, w, sizeof(st));
+        return s0 && st.layout == state_layout;
+    }
+    return 0;
+}
+
+csl::State_reader::~State_reader() {
+    if (block) munmap(const_cast<State_block *>(block), sizeof(State_block));
+    if (fd >= 0) close(fd);
+}
+
+
+// ************* Sequences *************
+
+csl::Sequence &csl::Sequence::operator = (Sequence &&o) {
+    if (this != &o) {
+        if (handle) handle.destroy();
+        handle = o.handle;
+        o.handle = nullptr;
+    }
+    return *this;
+}
+
+csl::Sequence::~Sequence() {if (handle) handle.destroy();}
+
+csl::Sequencer::Sequencer(Serial &s, Telemetry &t): serial(s), telemetry(t) {}
+
+static bool timer_later(const csl::Sequencer::Wait *a, const csl::Sequencer::Wait *b) {return a->deadline > b->deadline;}
+
+bool csl::Sequencer::satisfied(const Wait &w) {
+    switch (w.kind) {
+    case wait_delay:
+        return now >= w.deadline;
+    case wait_position:
+        if (!(telemetry.flags[w.axis] & Telemetry::flag_seen)) return false;
+        return w.above ? telemetry.position[w.axis] >= w.threshold : telemetry.position[w.axis] <= w.threshold;
+    case wait_cycles:
+        return cycle_count >= w.target;
+    case wait_text: {
+        // Text received since the wait started
+        const size_t at {rx_tail.rfind(w.text)};
+        return at != std::string::npos && rx_offset - rx_tail.size() + at >= w.target;
+    }
+    }
+    return false;
+}
+
+bool csl::Sequencer::Wait::await_ready() {return seq->satisfied(*this);}
+
+// The awaiter lives in the suspended sequence frame until resumed
+void csl::Sequencer::Wait::await_suspend(std::coroutine_handle<> h) {
+    handle = h;
+    if (kind == wait_delay || timed) {
+        seq->timers.push_back(this);
+        std::push_heap(seq->timers.begin(), seq->timers.end(), timer_later);
+    }
+    if (kind != wait_delay) seq->waits.push_back(this);
+}
+
+void csl::Sequencer::wake(Wait_kind kind) {
+    for (size_t i {0}; i < waits.size();) {
+        Wait *w {waits[i]};
+        if (w->kind == kind && satisfied(*w)) {
+            ready.push_back(w->handle);
+            waits[i] = waits.back();
+            waits.pop_back();
+            if (w->timed) {
+                timers.erase(std::find(timers.begin(), timers.end(), w));
+                std::make_heap(timers.begin(), timers.end(), timer_later);
+            }
+        } else i++;
+    }
+}
+
+void csl::Sequencer::spawn(Sequence sq) {
+    ready.push_back(sq.handle);
+    sequences.push_back(std::move(sq));
+}
+
+void csl::Sequencer::poll(sf::Time t) {
+    now = t;
+    while (timers.size() && timers.front()->deadline <= now) {
+        Wait *w {timers.front()};
+        std::pop_heap(timers.begin(), timers.end(), timer_later);
+        timers.pop_back();
+        if (w->kind != wait_delay) {
+            // Timed out
+            waits.erase(std::find(waits.begin(), waits.end(), w));
+            w->ok = false;
+        }
+        ready.push_back(w->handle);
+    }
+    // Resumed sequences may make others ready, run until idle
+    while (ready.size()) {
+        std::vector<std::coroutine_handle<>> run;
+        run.swap(ready);
+        for (auto h:run) h.resume();
+    }
+    for (size_t i {0}; i < sequences.size();) {
+        if (sequences[i].handle.done()) {
+            sequences[i] = std::move(sequences.back());
+            sequences.pop_back();
+        } else i++;
+    }
+}
+
+int csl::Sequencer::running() {return sequences.size();}
+
+void csl::Sequencer::on_serial(const std::string &str) {
+    rx_offset += str.size();
+    rx_tail += str;
+    wake(wait_text);
+    if (rx_tail.size() > 64) rx_tail.erase(0, rx_tail.size() - 64);
+}
+
+void csl::Sequencer::on_cycle(uint64_t count) {
+    cycle_count = count;
+    wake(wait_cycles);
+}
+
+void csl::Sequencer::on_telemetry() {wake(wait_position);}
+
+csl::Sequencer::Wait csl::Sequencer::delay(sf::Time dt) {
+    Wait w;
+    w.seq = this;
+    w.kind = wait_delay;
+    w.deadline = now + dt;
+    return w;
+}
+
+csl::Sequencer::Wait csl::Sequencer::position(int axis, double threshold, int above) {
+    Wait w;
+    w.seq = this;
+    w.kind = wait_position;
+    w.axis = axis < 0 ? 0 : axis >= Telemetry::max_axes ? Telemetry::max_axes - 1 : axis;
+    w.threshold = threshold;
+    w.above = above;
+    return w;
+}
+
+csl::Sequencer::Wait csl::Sequencer::cycles(uint64_t n) {
+    Wait w;
+    w.seq = this;
+    w.kind = wait_cycles;
+    w.target = cycle_count + n;
+    return w;
+}
+
+csl::Sequencer::Wait csl::Sequencer::received(const std::string &text, sf::Time timeout) {
+    Wait w;
+    w.seq = this;
+    w.kind = wait_text;
+    w.text = text;
+    w.target = rx_offset;
+    if (timeout > sf::Time::Zero) {
+        w.timed = 1;
+        w.deadline = now + timeout;
+    }
+    return w;
+}
+
+void csl::Sequencer::send(int cmd) {serial.non_blocking_write(cmd);}
+
 
 // ************* SFML Drawables *************
 
@@ -320,3 +1556,4 @@ csl::Serial::~Serial() {if (fd) close(fd);}
 ///     sf::Sprite m_sprite;
 ///     sf::Texture m_texture;
 ///     sf::VertexArray m_vertices;
+
@@ -0,0 +1,112 @@
+/*
+ * Project   Chrysalide Standard Library, tests
+ * Author    Jean-François Simon
+ * Company   Chrysalide Engineering
+ * Date      2024/02/14
+ * Version   1.0
+ */
+
+/*
+ *  Copyright 2024 Jean‐François Simon, Chrysalide Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright  notice,  this
+ * list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions  in  binary  form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * 3.  Neither  the  name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from  this  software  without
+ * specific prior written permission.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  TO,  THE  IMPLIED
+ * WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAI‐
+ * MED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE  LIABLE  FOR  ANY
+ * DIRECT,  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (IN‐
+ * CLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR  SERVICES;  LOSS
+ * OF  USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR  TORT  (INCLUDING
+ * NEGLIGENCE  OR  OTHERWISE)  ARISING  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Toolpath_view::parse_gcode() checks, stand alone (no window, no GL context):
+ *
+ *   cd sources
+ *   g++ -std=c++20 -Iincludes tests/gcode_test.cpp src/csl.cpp \
+ *       -lsfml-graphics -lsfml-window -lsfml-system -o gcode_test
+ *   ./gcode_test
+ */
+
+#include "csl.h"
+#include <cmath>
+#include <sstream>
+
+static int failures {0};
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        std::cout << "FAIL " << what << std::endl;
+        failures++;
+    }
+}
+
+static std::vector<sf::Vector2<float>> parse(const char *gcode) {
+    std::istringstream s {gcode};
+    return csl::Toolpath_view::parse_gcode(s);
+}
+
+static bool near(sf::Vector2<float> p, float x, float y) {return std::fabs(p.x - x) < 1e-3 && std::fabs(p.y - y) < 1e-3;}
+
+// Some intermediate point of the path close to (x, y)
+static bool passes(const std::vector<sf::Vector2<float>> &pts, float x, float y) {
+    for (auto &p:pts) if (std::fabs(p.x - x) < 0.01 && std::fabs(p.y - y) < 0.01) return true;
+    return false;
+}
+
+int main()
+{
+    // Words without spaces, no hex or exponent reading
+    {
+        const auto p {parse("G0X10Y5\nG1X10E2Y7\n")};
+        check(p.size() == 3, "no-space words, point count");
+        check(p.size() == 3 && near(p[1], 10, 5), "G0X10Y5");
+        check(p.size() == 3 && near(p[2], 10, 7), "X10E2 is X10");
+    }
+
+    // G91 relative moves, G90.1 / G91.1 don't change the distance mode
+    {
+        const auto p {parse("G1 X1 Y1\nG91 X1\nG90.1 X1\nG91.1 Y1\nG90 X0 Y0\n")};
+        check(p.size() == 6, "distance mode, point count");
+        check(p.size() == 6 && near(p[2], 2, 1) && near(p[3], 3, 1) && near(p[4], 3, 2) && near(p[5], 0, 0), "G91 / G90.1 / G91.1");
+    }
+
+    // Arcs: clockwise half circle from I J (incremental centre), then R
+    {
+        const auto p {parse("G2 X2 Y0 I1 J0\nG2 X4 Y0 R1\n")};
+        check(p.size() > 4 && near(p.back(), 4, 0), "arc end point");
+        check(passes(p, 1, 1), "G2 I J passes over the centre");
+        check(passes(p, 3, 1), "G2 R passes over the centre");
+    }
+
+    // Arcs: counter clockwise, absolute centre (G90.1), full circle from I J only
+    {
+        const auto p {parse("G0 X2 Y0\nG90.1 G3 X0 Y2 I0 J0\nG91.1 G3 I0 J-1\n")};
+        check(passes(p, std::sqrt(2.0f), std::sqrt(2.0f)), "G3 absolute centre");
+        check(passes(p, 0, 0) && near(p.back(), 0, 2), "G3 full circle");
+    }
+
+    // Axis words of non move G codes
+    {
+        const auto p {parse("G1 X1\nG92 X50 Y50\nG28 X9\nG53 G0 X9\nG4 X2\nG10 L2 X5\nG30 Y3\nG1 Y1\n")};
+        check(p.size() == 3 && near(p[1], 1, 0) && near(p[2], 1, 1), "G4 G10 G28 G30 G53 G92 are no moves");
+    }
+
+    std::cout << (failures ? "G-code tests failed" : "G-code tests passed") << std::endl;
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
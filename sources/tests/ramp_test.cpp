@@ -0,0 +1,97 @@
+/*
+ * Project   Chrysalide Standard Library, tests
+ * Author    Jean-François Simon
+ * Company   Chrysalide Engineering
+ * Date      2024/02/14
+ * Version   1.0
+ */
+
+/*
+ *  Copyright 2024 Jean‐François Simon, Chrysalide Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright  notice,  this
+ * list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions  in  binary  form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * 3.  Neither  the  name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from  this  software  without
+ * specific prior written permission.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  TO,  THE  IMPLIED
+ * WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAI‐
+ * MED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE  LIABLE  FOR  ANY
+ * DIRECT,  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (IN‐
+ * CLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR  SERVICES;  LOSS
+ * OF  USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR  TORT  (INCLUDING
+ * NEGLIGENCE  OR  OTHERWISE)  ARISING  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Ramp_table::encode() and ack() checks, stand alone (no serial port, no window):
+ *
+ *   cd sources
+ *   g++ -std=c++20 -Iincludes tests/ramp_test.cpp src/csl.cpp \
+ *       -lsfml-graphics -lsfml-window -lsfml-system -o ramp_test
+ *   ./ramp_test
+ */
+
+#include "csl.h"
+
+static int failures {0};
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        std::cout << "FAIL " << what << std::endl;
+        failures++;
+    }
+}
+
+int main()
+{
+    // Byte layout, little endian u16s, checksum: 2 entries of 12 bits
+    {
+        csl::Ramp_table t {csl::Ramp_table::trapezoidal, 2, 12, 0};
+        t.step_us = 300;      // 0x012C
+        t.speed_delta = 258;  // 0x0102
+        check(t.entries.size() == 2 && t.entries[0] == 0 && t.entries[1] == 0x0FFF, "12 bit entries");
+        //                         id count res step  delta entries  sum
+        check(t.encode(0) == "T" "00" "0200" "0C" "2C01" "0201" "0000FF0F" "4C" "\n", "frame bytes");
+    }
+
+    // Deceleration table, id and checksum
+    {
+        csl::Ramp_table t {csl::Ramp_table::trapezoidal, 5, 8, 1};
+        t.step_us = 15000;
+        t.speed_delta = 5;
+        check(t.encode(1) == "T01050008983A0500FF00BF00800040000000" "63" "\n", "deceleration frame");
+    }
+
+    // Upper case hex only between 'T' and '\n', checksum is the payload byte sum
+    {
+        const csl::Ramp_table t {csl::Ramp_table::s_curve, 300, 16, 0};
+        const std::string f {t.encode(7)};
+        int hex_only {f.size() % 2 == 0 && f.front() == 'T' && f.back() == '\n'};
+        for (size_t i {1}; i + 1 < f.size(); i++) {
+            const char c {f[i]};
+            if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))) hex_only = 0;
+        }
+        check(hex_only, "upper case hex");
+        unsigned char sum {0};
+        for (size_t i {1}; i + 3 < f.size(); i += 2) sum += std::stoi(f.substr(i, 2), nullptr, 16);
+        check(hex_only && sum == std::stoi(f.substr(f.size() - 3, 2), nullptr, 16), "checksum");
+    }
+
+    // Acknowledgement text
+    check(csl::Ramp_table::ack(0) == "T0OK" && csl::Ramp_table::ack(12) == "T12OK", "ack");
+
+    std::cout << (failures ? "Ramp table tests failed" : "Ramp table tests passed") << std::endl;
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+/*
+ * Project   Chrysalide Standard Library, tests
+ * Author    Jean-François Simon
+ * Company   Chrysalide Engineering
+ * Date      2024/02/14
+ * Version   1.0
+ */
+
+/*
+ *  Copyright 2024 Jean‐François Simon, Chrysalide Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright  notice,  this
+ * list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions  in  binary  form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * 3.  Neither  the  name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from  this  software  without
+ * specific prior written permission.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED  TO,  THE  IMPLIED
+ * WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAI‐
+ * MED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE  LIABLE  FOR  ANY
+ * DIRECT,  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (IN‐
+ * CLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR  SERVICES;  LOSS
+ * OF  USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR  TORT  (INCLUDING
+ * NEGLIGENCE  OR  OTHERWISE)  ARISING  IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Telemetry::parse() checks, stand alone (no serial port, no window):
+ *
+ *   cd sources
+ *   g++ -std=c++20 -Iincludes tests/telemetry_test.cpp src/csl.cpp \
+ *       -lsfml-graphics -lsfml-window -lsfml-system -o telemetry_test
+ *   ./telemetry_test
+ */
+
+#include "csl.h"
+
+static int failures {0};
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        std::cout << "FAIL " << what << std::endl;
+        failures++;
+    }
+}
+
+int main()
+{
+    // Tagged and untagged readbacks, foreign tags ignored
+    {
+        csl::Telemetry t {3};
+        check(t.parse("12>=Y-8>=Q5>=") == 2, "tagged readbacks");
+        check(t.steps[0] == 12 && t.steps[1] == -8, "tagged values");
+    }
+
+    // Readback split across chunks, including inside the delimiter
+    {
+        csl::Telemetry t {3};
+        check(t.parse("Z4") == 0 && t.parse("0>") == 0 && t.parse("=") == 1, "split readback");
+        check(t.steps[2] == 40, "split value");
+    }
+
+    // A tail that can't start a readback isn't carried over
+    {
+        csl::Telemetry t {1};
+        check(t.parse("0>=Z8>=\r\n") == 1, "line end tail");
+        check(t.parse("200>=") == 1 && t.steps[0] == 200, "readback after line end");
+        t.parse("1x");
+        check(t.parse("2>=") == 1 && t.steps[0] == 2, "readback after garbage");
+    }
+
+    // Cycle marks share chunks with readbacks
+    {
+        csl::Telemetry t {2};
+        check(t.parse(".Y30>=.") == 1 && t.steps[1] == 30, "readback between cycle marks");
+        check(t.parse("5>=") == 1 && t.steps[0] == 5, "readback after cycle mark");
+    }
+
+    std::cout << (failures ? "Telemetry tests failed" : "Telemetry tests passed") << std::endl;
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}